@@ -145,6 +145,14 @@ void block_print_stats(void) {
     }
 }
 
+/*! Stores the number of sectors read from and written to BLOCK in
+    READ_CNT and WRITE_CNT. */
+void block_get_stats(struct block *block, unsigned long long *read_cnt,
+                     unsigned long long *write_cnt) {
+    *read_cnt = block->read_cnt;
+    *write_cnt = block->write_cnt;
+}
+
 /*! Registers a new block device with the given NAME.  If EXTRA_INFO is
     non-null, it is printed as part of a user message.  The block device's
     SIZE in sectors and its TYPE must be provided, as well as the it operation
@@ -11,6 +11,7 @@
 #endif
 #ifdef FILESYS
 #include "devices/block.h"
+#include "filesys/cache.h"
 #include "filesys/filesys.h"
 #endif
 
@@ -111,6 +112,7 @@ static void print_stats(void) {
     thread_print_stats();
 #ifdef FILESYS
     block_print_stats();
+    cache_print_stats();
 #endif
     console_print_stats();
     kbd_print_stats();
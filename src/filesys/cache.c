@@ -1,65 +1,266 @@
 #include "cache.h"
 
 #include <debug.h>
+#include <inttypes.h>
 #include <kernel/hash.h>
+#include <round.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
 #include "devices/block.h"
 #include "devices/timer.h"
 #include "filesys/filesys.h" /* fs_device */
+#include "filesys/journal.h"
 #include "filesys/off_t.h"
 #include "lib/kernel/list.h"
 #include "threads/interrupt.h"
 #include "threads/malloc.h"
+#include "threads/palloc.h"
 #include "threads/synch.h"
 #include "threads/thread.h"
 
-/* Lock on accessing cache table. */
-struct lock cache_table_lock;
-
-/* Cache of data */
-static struct cache_entry sector_cache[CACHE_SIZE];
+/* Locking order. Each entry's cache_entry_lock may be held while acquiring
+   the cache_table_lock, and the cache_table_lock may be held while acquiring
+   stripe locks, but never the other way around. Only a thread holding the
+   cache_table_lock may hold more than one stripe lock at a time. */
 
-/* Read-ahead queue, clock-like index. */
-static int read_ahead_buffer[CACHE_SIZE];
-volatile int read_ahead_head;
-volatile int read_ahead_tail;
+/* Lock on allocating cache entries to sectors. Protects the replacement
+   policy's queues and the pool of never-used entries. */
+struct lock cache_table_lock;
 
-/* LRU cache. Since this should mimic the actual cache, it should
-   only be modified behind the cache_table_lock. */
-static struct list cache_lru;
+/* One stripe of the sector index. */
+struct cache_stripe {
+    struct lock lock;               /* Protects index. */
+    struct hash index;              /* Sector to cache entry. */
+};
+
+/* Index from sector number to cache entry, split into stripes by sector
+   so that threads touching different sectors don't contend. Every entry
+   whose sector is not CACHE_SECTOR_EMPTY is in the stripe of its sector,
+   and only there; stripes must be modified in lockstep with the sector
+   field, behind the stripe's lock. */
+static struct cache_stripe cache_stripes[CACHE_STRIPES];
+
+/* Cache of data, cache_size entries long. Sized at boot. */
+static struct cache_entry *sector_cache;
+static size_t cache_size;
+
+/* Sector data of all entries, cache_size sectors long; entry i's data is
+   the i'th sector, so a pointer handed out by cache_get() leads back to
+   its entry. */
+static uint8_t *cache_data;
+
+/* Entries at or above this index have never been handed out. */
+static size_t cache_unused;
+
+/* Threads in cache_acquire() that have failed to evict anything, and
+   the condition those that have gone a whole pass over the cache
+   without success sleep on. It is signaled, and the sequence count
+   bumped, when an entry is unpinned, committed or newly tracked. All
+   three are protected by the cache_table_lock, but wakers may peek at
+   the number of waiters without it. */
+static unsigned cache_evict_waiters;
+static unsigned cache_evictable_seq;
+static struct condition cache_evictable;
+
+/* How to fill a sector into a cache entry. */
+enum cache_fill {
+    CACHE_FILL_READ,                /* Read it in for a reader or writer. */
+    CACHE_FILL_OVERWRITE,           /* Don't read; it will be overwritten. */
+    CACHE_FILL_PREFETCH             /* Read it in ahead of use. */
+};
+
+/* Read-ahead queue: a ring of sectors to prefetch, filled by
+   cache_prefetch() and drained by the read_ahead thread, which sleeps on
+   read_ahead_nonempty while it's empty. Protected by read_ahead_lock. */
+static struct read_ahead_request {
+    block_sector_t sector;          /* Sector to read. */
+    enum cache_class class;         /* What it holds. */
+} read_ahead_queue[CACHE_READ_AHEAD_QUEUE];
+static size_t read_ahead_head;
+static size_t read_ahead_cnt;
+static struct lock read_ahead_lock;
+static struct condition read_ahead_nonempty;
+
+/* Dirty entries, in no particular order. An entry is on here exactly when
+   its dirty flag is set; both change together, behind the entry's lock and
+   dirty_lock. A dirty entry whose owner is known is also on its owner's
+   list, which dirty_lock protects as well. Those that hold metadata while
+   the journal is in use, bar new sectors (see cache_epoch), are counted
+   in journal_cnt, and are written back only by the journal's commits. */
+static struct list dirty_list;
+static size_t dirty_cnt;
+static size_t journal_cnt;
+static struct lock dirty_lock;
+
+/* Commits the journal has begun so far, plus one. A sector filled by
+   cache_write_new() in the current epoch is unreachable until the next
+   commit, which writes it back before anything that leads to it, so
+   the journal needn't log it. */
+static unsigned cache_epoch = 1;
+
+/* A dirty entry as it was when a flush began. */
+struct cache_dirty {
+    int sector;                     /* Sector the entry held. */
+    struct cache_entry *cache;      /* The entry. */
+};
+
+/* Replacement policy. Its queues mimic the actual cache, so all of its
+   hooks are called behind the cache_table_lock. Hits aren't reported to
+   the policy; readers and writers only set the entry's access bit, which
+   the policy may consult when it picks a victim. A victim must come from
+   the given region, unless that is CACHE_REGION_ANY. */
+struct cache_policy {
+    const char *name;                       /* Name for -cache-policy. */
+    void (*init)(void);                     /* Sets up empty queues. */
+    void (*insert)(struct cache_entry *);   /* Tracks a filled entry. */
+    struct cache_entry *(*evict)(enum cache_region); /* Untracks, returns
+                                                        a victim. */
+    void (*restore)(struct cache_entry *);  /* Takes back a victim that
+                                               wasn't evicted. */
+};
+
+static void lru_init(void);
+static void lru_insert(struct cache_entry *cache);
+static struct cache_entry *lru_evict(enum cache_region region);
+static void lru_restore(struct cache_entry *cache);
+
+static void twoq_init(void);
+static void twoq_insert(struct cache_entry *cache);
+static struct cache_entry *twoq_evict(enum cache_region region);
+static void twoq_restore(struct cache_entry *cache);
+
+static struct cache_entry *queue_evict(struct list *queue,
+    enum cache_region region, bool second_chance);
+
+static const struct cache_policy lru_policy = {
+    "lru", lru_init, lru_insert, lru_evict, lru_restore
+};
+static const struct cache_policy twoq_policy = {
+    "2q", twoq_init, twoq_insert, twoq_evict, twoq_restore
+};
+
+/* Policies selectable with -cache-policy. */
+static const struct cache_policy *cache_policies[] = {
+    &twoq_policy, &lru_policy
+};
+static const struct cache_policy *cache_policy = &twoq_policy;
+
+/* Entries in each region, and the share of the cache each is guaranteed.
+   Protected by the cache_table_lock. */
+static size_t cache_region_cnt[CACHE_REGION_CNT];
+static size_t cache_region_share[CACHE_REGION_CNT];
+static int cache_meta_percent = CACHE_META_PERCENT;
+
+/* Statistics. */
+static struct cache_stats cache_stats[CACHE_CLASS_CNT];
+static unsigned cache_optimistic_reads;
+static unsigned cache_optimistic_retries;
+static unsigned cache_lock_waits;
+static int64_t cache_lock_wait_ticks;
 
 /* Helper functions. */
+static unsigned cache_index_hash(const struct hash_elem *e, void *aux UNUSED);
+static bool cache_index_less(const struct hash_elem *a,
+    const struct hash_elem *b, void *aux UNUSED);
+static struct cache_stripe *sector_to_stripe(int sector);
+static struct cache_entry *stripe_find(struct cache_stripe *stripe,
+    block_sector_t sector);
+static void cache_index_set(struct cache_entry *cache, int sector);
+static enum cache_region cache_class_region(enum cache_class class);
+static void cache_track(struct cache_entry *cache, enum cache_region region);
+static void cache_restore(struct cache_entry *cache);
+static struct cache_entry *cache_pick_victim(enum cache_class class);
 static struct cache_entry *sector_to_cache(block_sector_t sector);
-static struct cache_entry *get_free_cache(block_sector_t sector, bool writing);
-static struct cache_entry *cache_evict(block_sector_t sector, bool writing);
-
-static struct cache_entry *lru_evict(void);
-static void lru_enqueue(block_sector_t sector);
-static void lru_update(void);
+static struct cache_entry *cache_acquire(block_sector_t sector,
+    bool overwrite, bool count, enum cache_class class);
+static void cache_evict_backoff(size_t *failures, unsigned *seq);
+static void cache_wake_evictors(void);
+static bool cache_read_optimistic(block_sector_t sector, void *buffer,
+    off_t size, off_t offset, enum cache_class class);
+static void cache_seq_bump(struct cache_entry *cache);
+static void cache_copy_out(struct cache_entry *cache, void *buffer,
+    off_t size, off_t offset);
+static void cache_copy_in(struct cache_entry *cache, const void *buffer,
+    off_t size, off_t offset, struct cache_owner *owner);
+static void cache_begin_read(struct cache_entry *cache);
+static void cache_end_read(struct cache_entry *cache);
+static void cache_begin_write(struct cache_entry *cache);
+static void cache_end_write(struct cache_entry *cache,
+    struct cache_owner *owner);
+static bool cache_pinned(const struct cache_entry *cache);
+static void cache_fill_misses(const struct cache_segment *segs, size_t cnt,
+    bool writing, enum cache_class class, bool *missed);
+static struct cache_entry *get_free_cache(block_sector_t sector,
+    enum cache_fill fill, enum cache_class class);
+static struct cache_entry *cache_evict(block_sector_t sector,
+    enum cache_fill fill, enum cache_class class);
+static void cache_fill(struct cache_entry *cache, enum cache_fill fill,
+    enum cache_class class);
+static void cache_mark_dirty(struct cache_entry *cache,
+    struct cache_owner *owner);
+static void cache_mark_clean(struct cache_entry *cache);
+static void cache_writeback(struct cache_entry *cache);
+static int cache_dirty_compare(const void *a, const void *b);
+static size_t cache_flush(struct cache_dirty *batch,
+    struct cache_owner *owner, bool (*wanted) (block_sector_t sector));
+
+static void cache_lock_acquire(struct lock *lock);
+static void cache_stat_inc(unsigned *counter);
 
 static void read_ahead(void *arg_ UNUSED);
 static void write_behind(void *arg_ UNUSED);
 
 
-/* Initialize. */
-void cache_init(void) {
+/* Initialize with room for SECTORS sectors. */
+void cache_init(size_t sectors) {
     read_ahead_head = 0;
-    read_ahead_tail = 0;
-
-    /* Init cache policy. */
-    list_init(&cache_lru);
+    read_ahead_cnt = 0;
+    lock_init(&read_ahead_lock);
+    cond_init(&read_ahead_nonempty);
 
     lock_init(&cache_table_lock);
+    cache_evict_waiters = 0;
+    cache_evictable_seq = 0;
+    cond_init(&cache_evictable);
+
+    list_init(&dirty_list);
+    dirty_cnt = 0;
+    journal_cnt = 0;
+    lock_init(&dirty_lock);
+
+    for (int i = 0; i < CACHE_STRIPES; i++) {
+        lock_init(&cache_stripes[i].lock);
+        if (!hash_init(&cache_stripes[i].index, cache_index_hash,
+                       cache_index_less, NULL)) {
+            PANIC("Couldn't allocate buffer cache index.");
+        }
+    }
 
-    for (int i = 0; i < CACHE_SIZE; i++) {
+    /* Entries and their data come straight out of the kernel pool. */
+    cache_size = sectors < CACHE_MIN_SIZE ? CACHE_MIN_SIZE : sectors;
+    cache_unused = 0;
+    sector_cache = palloc_get_multiple(PAL_ZERO,
+        DIV_ROUND_UP(cache_size * sizeof(struct cache_entry), PGSIZE));
+    cache_data = palloc_get_multiple(PAL_ZERO,
+        DIV_ROUND_UP(cache_size * BLOCK_SECTOR_SIZE, PGSIZE));
+    if (sector_cache == NULL || cache_data == NULL) {
+        PANIC("Couldn't allocate buffer cache of %zu sectors.", cache_size);
+    }
+
+    for (size_t i = 0; i < cache_size; i++) {
         sector_cache[i].sector = CACHE_SECTOR_EMPTY;
 
         sector_cache[i].access = false;
         sector_cache[i].dirty = false;
-        memset(&sector_cache[i].data, 0, BLOCK_SECTOR_SIZE);
+        sector_cache[i].owner = NULL;
+        sector_cache[i].journal = false;
+        sector_cache[i].fresh = 0;
+        sector_cache[i].prefetched = false;
+        sector_cache[i].class = CACHE_DATA;
+        sector_cache[i].data = cache_data + i * BLOCK_SECTOR_SIZE;
 
         lock_init(&sector_cache[i].cache_entry_lock);
 
@@ -69,12 +270,18 @@ void cache_init(void) {
         sector_cache[i].reader_active = 0;
         sector_cache[i].reader_waiting = 0;
         sector_cache[i].writer_waiting = 0;
-        
-        sector_cache[i].mode = UNLOCK;
 
-        /* Also, the read_ahead_buffer. */
-        read_ahead_buffer[i] = CACHE_SECTOR_EMPTY;
+        sector_cache[i].mode = UNLOCK;
+        sector_cache[i].seq = 0;
+        sector_cache[i].queue = CACHE_QUEUE_NONE;
     }
+
+    /* Init cache policy, now that we know how big the cache is. */
+    cache_region_share[CACHE_REGION_META] =
+        cache_size * cache_meta_percent / 100;
+    cache_region_share[CACHE_REGION_DATA] =
+        cache_size - cache_region_share[CACHE_REGION_META];
+    cache_policy->init();
 }
 
 void cache_kernel_thread_init(void) {
@@ -82,72 +289,273 @@ void cache_kernel_thread_init(void) {
     thread_create("cache-write-behind", PRI_DEFAULT, write_behind, NULL);
 }
 
-/* Returns a pointer to the sector's cache entry in the cache. Returns NULL if 
-sector is not in the cache. */
-static struct cache_entry * sector_to_cache(block_sector_t sector) {
-    int target_sector = (int) sector;
+/* Hashes a cache entry by its sector number. */
+static unsigned cache_index_hash(const struct hash_elem *e, void *aux UNUSED) {
+    const struct cache_entry *cache = hash_entry(e, struct cache_entry,
+                                                 hash_elem);
+    return hash_int(cache->sector);
+}
 
-    for (int i = 0; i < CACHE_SIZE; i++) {
-        if (sector_cache[i].sector == target_sector) {
-            return &sector_cache[i];
-        }
+/* Orders cache entries by sector number. */
+static bool cache_index_less(const struct hash_elem *a,
+                             const struct hash_elem *b, void *aux UNUSED) {
+    return hash_entry(a, struct cache_entry, hash_elem)->sector <
+           hash_entry(b, struct cache_entry, hash_elem)->sector;
+}
+
+/* Returns the stripe of the index that SECTOR belongs in. */
+static struct cache_stripe *sector_to_stripe(int sector) {
+    ASSERT(sector != CACHE_SECTOR_EMPTY);
+    return &cache_stripes[hash_int(sector) & (CACHE_STRIPES - 1)];
+}
+
+/* Returns the entry for SECTOR in STRIPE, or NULL if there is none. */
+static struct cache_entry *stripe_find(struct cache_stripe *stripe,
+                                       block_sector_t sector) {
+    ASSERT(lock_held_by_current_thread(&stripe->lock));
+
+    struct cache_entry key;
+    key.sector = (int) sector;
+    struct hash_elem *e = hash_find(&stripe->index, &key.hash_elem);
+
+    return e != NULL ? hash_entry(e, struct cache_entry, hash_elem) : NULL;
+}
+
+/* Moves CACHE to SECTOR, keeping the sector index in sync. SECTOR may be
+   CACHE_SECTOR_EMPTY, in which case the entry is only dropped from the
+   index. Takes the stripe locks it needs, so the caller must hold the
+   cache_table_lock and no stripe lock. */
+static void cache_index_set(struct cache_entry *cache, int sector) {
+    ASSERT(lock_held_by_current_thread(&cache_table_lock));
+
+    if (cache->sector != CACHE_SECTOR_EMPTY) {
+        struct cache_stripe *old = sector_to_stripe(cache->sector);
+        cache_lock_acquire(&old->lock);
+        hash_delete(&old->index, &cache->hash_elem);
+        cache->sector = CACHE_SECTOR_EMPTY;
+        lock_release(&old->lock);
     }
 
-    return NULL;
+    if (sector != CACHE_SECTOR_EMPTY) {
+        struct cache_stripe *new = sector_to_stripe(sector);
+        cache_lock_acquire(&new->lock);
+        cache->sector = sector;
+
+        /* A sector may only ever be loaded into one entry. */
+        struct hash_elem *old = hash_insert(&new->index, &cache->hash_elem);
+        ASSERT(old == NULL);
+        lock_release(&new->lock);
+    }
 }
 
-/* Reads cache data at "cache" into buffer. */
-void cache_read(block_sector_t sector, void * buffer, off_t size, off_t offset) {
-    // printf("    READING: %d\n", sector);
-    ASSERT((int) sector != CACHE_SECTOR_EMPTY);
-    ASSERT(size + offset <= BLOCK_SECTOR_SIZE);
-    // printf("Read at sector %d, %d bytes at offset %d\n", sector, size, offset);
+/* Returns a pointer to the sector's cache entry in the cache. Returns NULL if
+sector is not in the cache. The entry is not locked, so the caller must
+verify its sector once it has locked it. */
+static struct cache_entry * sector_to_cache(block_sector_t sector) {
+    struct cache_stripe *stripe = sector_to_stripe((int) sector);
+
+    cache_lock_acquire(&stripe->lock);
+    struct cache_entry *cache = stripe_find(stripe, sector);
+    lock_release(&stripe->lock);
+
+    return cache;
+}
 
+/* Returns the cache entry holding SECTOR, with its cache_entry_lock held,
+   loading it first if need be. If OVERWRITE, the caller will overwrite the
+   whole sector before releasing the lock, so it is never read in from
+   disk. If COUNT, finding it already loaded is recorded as a hit. The
+   entry is accounted to CLASS from now on. */
+static struct cache_entry *cache_acquire(block_sector_t sector,
+                                         bool overwrite, bool count,
+                                         enum cache_class class) {
     struct cache_entry *cache = NULL;
+    size_t failures = 0;
+    unsigned seq = 0;
 
     /* Looping is done to avoid situations where we obtain a cache,
        switch to a thread that changes our cache, and then switch
        back- here, we ensure that our cache still contains the
        correct sector. */
     while (1) {
-        /* Acquire global lock and cache entry. */
-        lock_acquire(&cache_table_lock);
-        ASSERT(list_size(&cache_lru) <= CACHE_SIZE);
         cache = sector_to_cache(sector);
-        lock_release(&cache_table_lock);
+        bool hit = cache != NULL;
 
         if (!cache) {
             /* Sector is not currently in cache- switch it in. */
-            lock_acquire(&cache_table_lock);
-            ASSERT(list_size(&cache_lru) <= CACHE_SIZE);
-            cache = get_free_cache(sector, false);
+            cache = get_free_cache(sector, overwrite ? CACHE_FILL_OVERWRITE
+                                                     : CACHE_FILL_READ,
+                                   class);
         } else {
-            /* Lock cache until we finish reading from it. */
-            lock_acquire(&cache->cache_entry_lock);
+            /* Lock cache until we finish with it. */
+            cache_lock_acquire(&cache->cache_entry_lock);
         }
 
         /* Verify that we got a cache this time around. */
         if (!cache) {
+            cache_evict_backoff(&failures, &seq);
             continue;
         }
 
         /* Should've switched locks. */
         ASSERT(!lock_held_by_current_thread(&cache_table_lock));
         ASSERT(lock_held_by_current_thread(&cache->cache_entry_lock));
-        
+
         /* Ensure that this is still the correct sector. */
         if (cache->sector == (int) sector) {
             /* We gud. */
-            break;
+            if (hit && count) {
+                cache_stat_inc(&cache_stats[class].hits);
+            }
+            if (cache->prefetched) {
+                cache->prefetched = false;
+                cache_stat_inc(&cache_stats[cache->class].read_ahead_used);
+            }
+            cache->class = class;
+
+            if (failures > 0) {
+                cache_lock_acquire(&cache_table_lock);
+                cache_evict_waiters--;
+                lock_release(&cache_table_lock);
+            }
+            return cache;
         } else {
             /* We not gud. */
             lock_release(&cache->cache_entry_lock);
         }
     }
+}
+
+/* Called by cache_acquire() each time it finds nothing to evict, because
+   its victims were pinned or left to the journal, or all were being
+   evicted by others. Retrying picks another victim, so it carries on
+   until it has failed a whole pass over the cache; then it sleeps until
+   some entry may have become evictable since the first failure, instead
+   of spinning while the threads that could unpin or commit need the CPU.
+   *FAILURES and *SEQ, zero to begin with, keep track of this. */
+static void cache_evict_backoff(size_t *failures, unsigned *seq) {
+    cache_lock_acquire(&cache_table_lock);
+    if ((*failures)++ == 0) {
+        cache_evict_waiters++;
+        *seq = cache_evictable_seq;
+    } else if (*failures > cache_size) {
+        if (*seq == cache_evictable_seq) {
+            cond_wait(&cache_evictable, &cache_table_lock);
+        }
+        *seq = cache_evictable_seq;
+        *failures = 1;
+    }
+    lock_release(&cache_table_lock);
+}
+
+/* Wakes threads waiting in cache_evict_backoff(), because some entry may
+   have become evictable. The unlocked look at the number of waiters can
+   miss one that is just registering; that waiter still has a whole pass
+   over the cache to find the entry before it sleeps. */
+static void cache_wake_evictors(void) {
+    if (cache_evict_waiters == 0) {
+        return;
+    }
+
+    bool held = lock_held_by_current_thread(&cache_table_lock);
+    if (!held) {
+        cache_lock_acquire(&cache_table_lock);
+    }
+    cache_evictable_seq++;
+    cond_broadcast(&cache_evictable, &cache_table_lock);
+    if (!held) {
+        lock_release(&cache_table_lock);
+    }
+}
+
+/* Reads cache data at "cache" into buffer. SECTOR holds CLASS of data. */
+void cache_read(block_sector_t sector, void * buffer, off_t size, off_t offset,
+                enum cache_class class) {
+    ASSERT((int) sector != CACHE_SECTOR_EMPTY);
+    ASSERT(size + offset <= BLOCK_SECTOR_SIZE);
+
+    if (cache_read_optimistic(sector, buffer, size, offset, class)) {
+        return;
+    }
+
+    struct cache_entry *cache = cache_acquire(sector, false, true, class);
 
     /* Really shouldn't be null. */
     ASSERT(cache);
 
+    cache_copy_out(cache, buffer, size, offset);
+}
+
+/* Tries to read SIZE bytes at OFFSET in SECTOR, which holds CLASS of data,
+   into BUFFER without locking its entry: the data is copied between two
+   reads of the entry's sequence number, and kept only if no writer,
+   fill or eviction got in between. Returns false if the sector isn't
+   cached or the copy was spoiled, in which case the caller must take the
+   locked path. */
+static bool cache_read_optimistic(block_sector_t sector, void *buffer,
+                                  off_t size, off_t offset,
+                                  enum cache_class class) {
+    struct cache_entry *cache = sector_to_cache(sector);
+    if (cache == NULL) {
+        return false;
+    }
+
+    unsigned seq = cache->seq;
+    barrier();
+
+    /* Read-ahead and class bookkeeping need the entry lock. */
+    if (seq % 2 != 0 || cache->sector != (int) sector || cache->prefetched
+        || cache->class != class) {
+        cache_stat_inc(&cache_optimistic_retries);
+        return false;
+    }
+
+    memcpy(buffer, cache->data + offset, (size_t) size);
+    barrier();
+
+    if (cache->seq != seq) {
+        cache_stat_inc(&cache_optimistic_retries);
+        return false;
+    }
+
+    cache->access = true;
+    cache_stat_inc(&cache_stats[class].hits);
+    cache_stat_inc(&cache_optimistic_reads);
+    return true;
+}
+
+/* Starts or finishes a change to CACHE's sector or data, which the caller
+   has locked, so that optimistic readers of it start over. */
+static void cache_seq_bump(struct cache_entry *cache) {
+    ASSERT(lock_held_by_current_thread(&cache->cache_entry_lock));
+
+    barrier();
+    cache->seq++;
+    barrier();
+}
+
+/* Reads SIZE bytes at OFFSET in CACHE into BUFFER. Takes over the caller's
+   hold on the cache_entry_lock, and releases it. */
+static void cache_copy_out(struct cache_entry *cache, void *buffer,
+                           off_t size, off_t offset) {
+    cache_begin_read(cache);
+
+    /* Carry out actual read. */
+    memcpy(buffer, cache->data + offset, (size_t) size);
+    cache->access = true;
+
+    cache_end_read(cache);
+
+    /* We done, we release. */
+    lock_release(&cache->cache_entry_lock);
+}
+
+/* Takes a read lock on CACHE, whose cache_entry_lock the caller holds,
+   waiting for any writer to finish first. */
+static void cache_begin_read(struct cache_entry *cache) {
+    ASSERT(lock_held_by_current_thread(&cache->cache_entry_lock));
+    int sector = cache->sector;
+
     if (cache->mode == UNLOCK) {
         /* Don't need to wait. */
         cache->mode = READ_LOCK;
@@ -161,23 +569,23 @@ void cache_read(block_sector_t sector, void * buffer, off_t size, off_t offset)
         cond_wait(&cache->readers, &cache->cache_entry_lock);
         cache->reader_waiting--;
 
-        /* Passing around the lock between waiters shouldn't change the 
+        /* Passing around the lock between waiters shouldn't change the
            cache sector. */
-        ASSERT(cache->sector == (int) sector);
+        ASSERT(cache->sector == sector);
     }
 
     /* Begin reading. */
     cache->reader_active++;
     ASSERT(cache->mode == READ_LOCK);
+}
 
-    /* Carry out actual read. */
-    memcpy(buffer, (void *) (&cache->data) + offset, (size_t) size);
-    cache->access = true;
-    cache->reader_active--;
+/* Drops a read lock on CACHE, whose cache_entry_lock the caller holds. */
+static void cache_end_read(struct cache_entry *cache) {
+    ASSERT(lock_held_by_current_thread(&cache->cache_entry_lock));
+    ASSERT(cache->mode == READ_LOCK);
+    ASSERT(cache->reader_active > 0);
 
-    /* Line up read ahead. */
-    read_ahead_buffer[read_ahead_tail] = (sector + 1) % block_size(fs_device);
-    read_ahead_tail = (read_ahead_tail + 1) % CACHE_SIZE;
+    cache->reader_active--;
 
     /* If we're done reading, reset state. */
     if (cache->reader_active == 0 && cache->writer_waiting > 0) {
@@ -187,61 +595,100 @@ void cache_read(block_sector_t sector, void * buffer, off_t size, off_t offset)
     } else if (cache->reader_active == 0 && cache->writer_waiting == 0) {
         /* Just set to unlock. */
         cache->mode = UNLOCK;
+        cache_wake_evictors();
     } /* else: More readers, let them take care of cleanup. */
-
-    /* We done, we release. */
-    lock_release(&cache->cache_entry_lock);
 }
 
-/* Reads from buffer into cache data at "cache". 
-   Write sector SECTOR to CACHE from BUFFER, which must contain
-   BLOCK_SECTOR_SIZE bytes.*/
-void cache_write(block_sector_t sector, const void * buffer, off_t size, off_t offset) {
-    // printf("    WRITING: %d\n", sector);
+/* Writes SIZE bytes from BUFFER to OFFSET in sector SECTOR. The sector is
+   only read in from disk first if it isn't cached and the write leaves
+   some of its old contents in place. SECTOR holds CLASS of data, and
+   belongs to OWNER if it is not null. */
+void cache_write(block_sector_t sector, const void * buffer, off_t size,
+                 off_t offset, enum cache_class class,
+                 struct cache_owner *owner) {
     ASSERT((int) sector != CACHE_SECTOR_EMPTY);
     ASSERT(size + offset <= BLOCK_SECTOR_SIZE);
 
-    struct cache_entry *cache = NULL;
-    // TODO don't need to read from disk when we load from disk because we
-    // necessarily overwrite the whole sector
+    bool whole = offset == 0 && size == BLOCK_SECTOR_SIZE;
+    struct cache_entry *cache = cache_acquire(sector, whole, true, class);
 
-    while (1) {
-        /* Acquire global lock and cache entry. */
-        lock_acquire(&cache_table_lock);
-        ASSERT(list_size(&cache_lru) <= CACHE_SIZE);
-        cache = sector_to_cache(sector);
-        lock_release(&cache_table_lock);
+    /* Really shouldn't be null. */
+    ASSERT(cache);
 
-        if (!cache) {
-            lock_acquire(&cache_table_lock);
-            ASSERT(list_size(&cache_lru) <= CACHE_SIZE);
-            cache = get_free_cache(sector, true);
-        } else {
-            lock_acquire(&cache->cache_entry_lock);
-        }
+    cache_copy_in(cache, buffer, size, offset, owner);
+}
 
-        /* Verify that we got a cache this time around. */
-        if (!cache) {
-            continue;
-        }
+/* Fills sector SECTOR with zeros, without reading it from disk or copying
+   from a buffer of zeros. SECTOR must have just been allocated, as for
+   cache_write_new(). It holds CLASS of data, and belongs to OWNER if it
+   is not null. */
+void cache_zero(block_sector_t sector, enum cache_class class,
+                struct cache_owner *owner) {
+    cache_write_new(sector, NULL, class, owner);
+}
 
-        /* Should've switched locks. */
-        ASSERT(!lock_held_by_current_thread(&cache_table_lock));
-        ASSERT(lock_held_by_current_thread(&cache->cache_entry_lock));
-        
-        /* Ensure that this is still the correct sector. */
-        if (cache->sector == (int) sector) {
-            /* We gud. */
-            break;
-        } else {
-            /* We not gud. */
-            lock_release(&cache->cache_entry_lock);
-        }
-    }
+/* Fills sector SECTOR, which has just been allocated, with the
+   BLOCK_SECTOR_SIZE bytes in BUFFER, or zeros if BUFFER is null. Neither
+   this nor later writes to it that find it still cached go by the
+   journal before it next commits. SECTOR holds CLASS of data, and
+   belongs to OWNER if it is not null. */
+void cache_write_new(block_sector_t sector, const void *buffer,
+                     enum cache_class class, struct cache_owner *owner) {
+    ASSERT((int) sector != CACHE_SECTOR_EMPTY);
+
+    struct cache_entry *cache = cache_acquire(sector, true, true, class);
 
     /* Really shouldn't be null. */
     ASSERT(cache);
 
+    cache->fresh = cache_epoch;
+    cache_copy_in(cache, buffer, BLOCK_SECTOR_SIZE, 0, owner);
+}
+
+/* Forgets what was written to SECTOR, which has just been freed, so that
+   it isn't written back. */
+void cache_discard(block_sector_t sector) {
+    ASSERT((int) sector != CACHE_SECTOR_EMPTY);
+
+    struct cache_entry *cache = sector_to_cache(sector);
+    if (cache == NULL) {
+        return;
+    }
+
+    cache_lock_acquire(&cache->cache_entry_lock);
+    if (cache->sector == (int) sector && !cache_pinned(cache)) {
+        cache_mark_clean(cache);
+    }
+    lock_release(&cache->cache_entry_lock);
+}
+
+/* Writes SIZE bytes from BUFFER to OFFSET in CACHE, or zeros if BUFFER is
+   null, on behalf of OWNER. Takes over the caller's hold on the
+   cache_entry_lock, and releases it. */
+static void cache_copy_in(struct cache_entry *cache, const void *buffer,
+                          off_t size, off_t offset,
+                          struct cache_owner *owner) {
+    cache_begin_write(cache);
+
+    /* Carry out actual write operation. */
+    if (buffer != NULL) {
+        memcpy(cache->data + offset, buffer, (size_t) size);
+    } else {
+        memset(cache->data + offset, 0, (size_t) size);
+    }
+    cache->access = true;
+
+    cache_end_write(cache, owner);
+
+    /* We done, we release. */
+    lock_release(&cache->cache_entry_lock);
+}
+
+/* Takes the write lock on CACHE, whose cache_entry_lock the caller holds,
+   waiting for readers and any other writer to finish first. */
+static void cache_begin_write(struct cache_entry *cache) {
+    ASSERT(lock_held_by_current_thread(&cache->cache_entry_lock));
+
     if (cache->mode == UNLOCK) {
         cache->mode = WRITE_LOCK;
     } else {
@@ -254,14 +701,18 @@ void cache_write(block_sector_t sector, const void * buffer, off_t size, off_t o
     ASSERT(cache->mode == WRITE_LOCK);
     ASSERT(cache->reader_active == 0);
 
-    /* Carry out actual write operation. */
-    memcpy((void *) &cache->data + offset, buffer, (size_t) size);
-    cache->access = true;
-    cache->dirty = true;
+    cache_seq_bump(cache);
+}
 
-    /* Line up read ahead. */
-    read_ahead_buffer[read_ahead_tail] = (sector + 1) % block_size(fs_device);
-    read_ahead_tail = (read_ahead_tail + 1) % CACHE_SIZE;
+/* Drops the write lock on CACHE, whose cache_entry_lock the caller holds,
+   and marks it dirty on behalf of OWNER. */
+static void cache_end_write(struct cache_entry *cache,
+                            struct cache_owner *owner) {
+    ASSERT(lock_held_by_current_thread(&cache->cache_entry_lock));
+    ASSERT(cache->mode == WRITE_LOCK);
+
+    cache_seq_bump(cache);
+    cache_mark_dirty(cache, owner);
 
     /* Once we're done, signal the next threads. */
     if (cache->reader_waiting > 0) {
@@ -274,60 +725,262 @@ void cache_write(block_sector_t sector, const void * buffer, off_t size, off_t o
     } else {
         /* No one waiting. */
         cache->mode = UNLOCK;
+        cache_wake_evictors();
     }
+}
 
-    /* We done, we release. */
+/* Returns true if some thread holds or is being handed CACHE's read/write
+   lock, whose cache_entry_lock the caller holds. Such an entry must keep
+   its sector. */
+static bool cache_pinned(const struct cache_entry *cache) {
+    ASSERT(lock_held_by_current_thread(&cache->cache_entry_lock));
+
+    return cache->mode != UNLOCK;
+}
+
+/* Pins SECTOR, which holds CLASS of data, in the cache and returns its
+   BLOCK_SECTOR_SIZE bytes of data in place, read locked, or write locked if
+   WRITE. The sector can't be evicted, and nobody else can write it (or,
+   if WRITE, read it) until the pointer is given back to cache_put().
+   Pins should be short, and a thread must not otherwise access a sector
+   it has pinned for writing. Sectors pinned together must be pinned in a
+   consistent order, such as from the root of an index down. A sector
+   pinned for writing belongs to OWNER, if it is not null. */
+void *cache_get(block_sector_t sector, bool write, enum cache_class class,
+                struct cache_owner *owner) {
+    ASSERT((int) sector != CACHE_SECTOR_EMPTY);
+
+    struct cache_entry *cache = cache_acquire(sector, false, true, class);
+
+    /* Really shouldn't be null. */
+    ASSERT(cache);
+
+    if (write) {
+        cache_begin_write(cache);
+
+        /* Tag it now; the flusher leaves it alone until it's unpinned. */
+        cache_mark_dirty(cache, owner);
+    } else {
+        cache_begin_read(cache);
+    }
+    cache->access = true;
     lock_release(&cache->cache_entry_lock);
+
+    return cache->data;
 }
 
-static struct cache_entry *get_free_cache(block_sector_t sector, bool writing) {
-    ASSERT(lock_held_by_current_thread(&cache_table_lock));
-    ASSERT(list_size(&cache_lru) <= CACHE_SIZE);
-
-    for (int i = 0; i < CACHE_SIZE; i++) {
-        if (sector_cache[i].sector == CACHE_SECTOR_EMPTY) {
-            ASSERT(lock_try_acquire(&sector_cache[i].cache_entry_lock));
-            /* If this is actually free, no one holds this lock. */
-            ASSERT(sector_cache[i].mode == UNLOCK);
-            ASSERT(sector_cache[i].reader_active == 0);
-            ASSERT(sector_cache[i].writer_waiting == 0);
-
-            /* Keep track of page in LRU queue. */
-            lru_enqueue(sector);
-            sector_cache[i].sector = sector;
-
-            /* Relinquish control of cache table. */
-            lock_release(&cache_table_lock);
-
-            /* Read in new memory, unless we're immediately going to 
-               overwrite it. */
-            // TODO : review memset policy
-            // memset(&sector_cache[i].data, 0, BLOCK_SECTOR_SIZE);
-            if (!writing) {
-                block_read(fs_device, sector, &sector_cache[i].data); 
+/* Unpins the sector whose DATA cache_get() returned. If it was pinned for
+   writing, it is marked dirty. */
+void cache_put(const void *data) {
+    ASSERT(data != NULL);
+
+    size_t i = ((const uint8_t *) data - cache_data) / BLOCK_SECTOR_SIZE;
+    ASSERT(i < cache_size);
+
+    struct cache_entry *cache = &sector_cache[i];
+    ASSERT(cache->data == data);
+
+    cache_lock_acquire(&cache->cache_entry_lock);
+    if (cache->mode == WRITE_LOCK) {
+        cache_end_write(cache, NULL);
+    } else {
+        cache_end_read(cache);
+    }
+    lock_release(&cache->cache_entry_lock);
+}
+
+/* Orders sector numbers. */
+static int sector_compare(const void *a_, const void *b_) {
+    const block_sector_t *a = a_;
+    const block_sector_t *b = b_;
+
+    return (*a > *b) - (*a < *b);
+}
+
+/* Loads every sector among the CNT segments in SEGS that isn't cached and
+   whose old contents matter, in ascending order, before any of them is
+   copied. Sets MISSED[i] if the sector of SEGS[i] wasn't cached. CNT must
+   be at most CACHE_RANGE_BATCH. */
+static void cache_fill_misses(const struct cache_segment *segs, size_t cnt,
+                              bool writing, enum cache_class class,
+                              bool *missed) {
+    ASSERT(cnt <= CACHE_RANGE_BATCH);
+
+    block_sector_t fills[CACHE_RANGE_BATCH];
+    size_t fill_cnt = 0;
+
+    for (size_t i = 0; i < cnt; i++) {
+        missed[i] = sector_to_cache(segs[i].sector) == NULL;
+
+        /* A whole-sector write doesn't need the old contents. */
+        bool whole = segs[i].offset == 0 && segs[i].size == BLOCK_SECTOR_SIZE;
+        if (missed[i] && !(writing && whole)) {
+            fills[fill_cnt++] = segs[i].sector;
+        }
+    }
+
+    qsort(fills, fill_cnt, sizeof *fills, sector_compare);
+
+    for (size_t i = 0; i < fill_cnt; i++) {
+        if (i > 0 && fills[i] == fills[i - 1]) {
+            continue;
+        }
+
+        /* Someone else may have loaded it meanwhile; if not, it may be
+           evicted again before we get to it, which only costs a refill. */
+        if (!sector_to_cache(fills[i])) {
+            struct cache_entry *cache =
+                get_free_cache(fills[i], CACHE_FILL_READ, class);
+            if (cache) {
+                lock_release(&cache->cache_entry_lock);
             }
+        }
+    }
+}
+
+/* Reads the CNT segments in SEGS, in order, into consecutive bytes of
+   BUFFER. Misses among each batch of segments are filled together first,
+   so the disk sees one ascending pass over them. The sectors hold CLASS of
+   data. */
+void cache_read_range(const struct cache_segment *segs, size_t cnt,
+                      void *buffer_, enum cache_class class) {
+    uint8_t *buffer = buffer_;
+    bool missed[CACHE_RANGE_BATCH];
+
+    for (size_t first = 0; first < cnt; first += CACHE_RANGE_BATCH) {
+        size_t batch = cnt - first < CACHE_RANGE_BATCH ? cnt - first
+                                                       : CACHE_RANGE_BATCH;
+        cache_fill_misses(segs + first, batch, false, class, missed);
+
+        for (size_t i = 0; i < batch; i++) {
+            const struct cache_segment *seg = &segs[first + i];
+            ASSERT((int) seg->sector != CACHE_SECTOR_EMPTY);
+            ASSERT(seg->size + seg->offset <= BLOCK_SECTOR_SIZE);
+
+            if (missed[i] || !cache_read_optimistic(seg->sector, buffer,
+                                                    seg->size, seg->offset,
+                                                    class)) {
+                struct cache_entry *cache = cache_acquire(seg->sector, false,
+                                                          !missed[i], class);
+                cache_copy_out(cache, buffer, seg->size, seg->offset);
+            }
+            buffer += seg->size;
+        }
+    }
+}
 
-            return &sector_cache[i];
+/* Writes consecutive bytes of BUFFER into the CNT segments in SEGS, in
+   order. Sectors only partly overwritten are read in first, in one
+   ascending pass per batch of segments. The sectors hold CLASS of data,
+   and belong to OWNER if it is not null. */
+void cache_write_range(const struct cache_segment *segs, size_t cnt,
+                       const void *buffer_, enum cache_class class,
+                       struct cache_owner *owner) {
+    const uint8_t *buffer = buffer_;
+    bool missed[CACHE_RANGE_BATCH];
+
+    for (size_t first = 0; first < cnt; first += CACHE_RANGE_BATCH) {
+        size_t batch = cnt - first < CACHE_RANGE_BATCH ? cnt - first
+                                                       : CACHE_RANGE_BATCH;
+        cache_fill_misses(segs + first, batch, true, class, missed);
+
+        for (size_t i = 0; i < batch; i++) {
+            const struct cache_segment *seg = &segs[first + i];
+            ASSERT((int) seg->sector != CACHE_SECTOR_EMPTY);
+            ASSERT(seg->size + seg->offset <= BLOCK_SECTOR_SIZE);
+
+            bool whole = seg->offset == 0 && seg->size == BLOCK_SECTOR_SIZE;
+            struct cache_entry *cache = cache_acquire(seg->sector, whole,
+                                                      !missed[i], class);
+            cache_copy_in(cache, buffer, seg->size, seg->offset, owner);
+            buffer += seg->size;
         }
     }
+}
+
+/* Fills SECTOR, already recorded in CACHE, from disk according to FILL,
+   accounting it to CLASS. */
+static void cache_fill(struct cache_entry *cache, enum cache_fill fill,
+                       enum cache_class class) {
+    ASSERT(lock_held_by_current_thread(&cache->cache_entry_lock));
+
+    cache->class = class;
+    cache->fresh = 0;
+    cache_stat_inc(&cache_stats[class].misses);
+
+    cache->prefetched = fill == CACHE_FILL_PREFETCH;
+    if (fill == CACHE_FILL_PREFETCH) {
+        cache_stat_inc(&cache_stats[class].read_ahead_issued);
+    }
+
+    /* Read in new memory, unless we're immediately going to overwrite
+       it. */
+    if (fill != CACHE_FILL_OVERWRITE) {
+        block_read(fs_device, cache->sector, cache->data);
+    }
 
-    return cache_evict(sector, writing);
+    /* The caller started the change before moving the entry to SECTOR. */
+    cache_seq_bump(cache);
 }
 
+/* Loads SECTOR into a never-used entry if there is one, or else evicts
+   some other sector to make room. Returns the entry with its lock held,
+   or NULL if the caller should try again. */
+static struct cache_entry *get_free_cache(block_sector_t sector,
+                                          enum cache_fill fill,
+                                          enum cache_class class) {
+    cache_lock_acquire(&cache_table_lock);
+
+    /* Someone may have loaded the sector since we last looked. Anyone else
+       loading it has to come through here, so this check holds until we
+       release the cache_table_lock. */
+    struct cache_entry *loaded_cache = sector_to_cache(sector);
+    if (loaded_cache) {
+        lock_release(&cache_table_lock);
+        cache_lock_acquire(&loaded_cache->cache_entry_lock);
+        return loaded_cache;
+    }
+
+    if (cache_unused < cache_size) {
+        struct cache_entry *cache = &sector_cache[cache_unused++];
 
-/* Comment */
-static struct cache_entry *cache_evict(block_sector_t sector, bool writing) {
-    // TODO: something better
+        ASSERT(cache->sector == CACHE_SECTOR_EMPTY);
+        ASSERT(lock_try_acquire(&cache->cache_entry_lock));
+        /* If this is actually free, no one holds this lock. */
+        ASSERT(cache->mode == UNLOCK);
+        ASSERT(cache->reader_active == 0);
+        ASSERT(cache->writer_waiting == 0);
+
+        /* Keep track of page in replacement policy. */
+        cache_seq_bump(cache);
+        cache_index_set(cache, sector);
+        cache_track(cache, cache_class_region(class));
+
+        /* Relinquish control of cache table. */
+        lock_release(&cache_table_lock);
+
+        cache_fill(cache, fill, class);
+        return cache;
+    }
+
+    return cache_evict(sector, fill, class);
+}
+
+
+/* Evicts the sector the replacement policy picks to make room for SECTOR.
+   Called with the cache_table_lock held, which it releases. */
+static struct cache_entry *cache_evict(block_sector_t sector,
+                                       enum cache_fill fill,
+                                       enum cache_class class) {
     ASSERT(lock_held_by_current_thread(&cache_table_lock));
-    ASSERT(list_size(&cache_lru) <= CACHE_SIZE);
 
     /* Choose victim. */
-    struct cache_entry *cache = lru_evict();
+    struct cache_entry *cache = cache_pick_victim(class);
 
     /* Switch locks. */
     lock_release(&cache_table_lock);
 
-    /* It is possible that our cache entry is NULL, i.e. all pages have 
+    /* It is possible that our cache entry is NULL, i.e. all pages have
        been evicted ahead of us. In such case, we return NULL and re-run
        the while loop. */
     if (!cache) {
@@ -338,239 +991,817 @@ static struct cache_entry *cache_evict(block_sector_t sector, bool writing) {
        The idea is that when they wake up at some point, they acquire the lock,
        realize that this is no longer the data that they want, and then
        relinquish it. */
-    lock_acquire(&cache->cache_entry_lock);
+    cache_lock_acquire(&cache->cache_entry_lock);
+
+    /* Someone pinned the victim before we got to it, or it holds metadata
+       that mustn't reach the disk before it's committed. Give it back to
+       the policy and have the caller try again. */
+    if (cache_pinned(cache) || cache->journal) {
+        cache_lock_acquire(&cache_table_lock);
+        cache_restore(cache);
+        lock_release(&cache_table_lock);
+        lock_release(&cache->cache_entry_lock);
+        return NULL;
+    }
+
+    /* Write out the old sector (if it's dirty) while the entry still maps
+       it, so that nobody can read it back in from disk until the disk is
+       up to date. */
+    if (cache->dirty) {
+        /* Occassionally, need to flush stored files when a thread closes. This
+           requires enabling interrupts. */
+        enum intr_level old_level = intr_enable();
+        cache_writeback(cache);
+        intr_set_level(old_level);
+    }
 
-    /* We relock the cache table here to ensure that processes cannot 
+    /* We relock the cache table here to ensure that processes cannot
        concurrently load the same sector into cache memory twice. */
-    lock_acquire(&cache_table_lock);
-    ASSERT(list_size(&cache_lru) <= CACHE_SIZE);
+    cache_lock_acquire(&cache_table_lock);
 
     struct cache_entry *loaded_cache = sector_to_cache(sector);
     if (loaded_cache) {
         /* Cache we were going to use has been removed from queue, and
            thus should still be paged in. We raise its priority unnecessarily,
            but that's not a big issue. */
-        lru_enqueue(cache->sector);
-
+        cache_restore(cache);
 
         /* If it's already loaded, we only need to lock that cache entry. */
         lock_release(&cache_table_lock);
         lock_release(&cache->cache_entry_lock);
-        lock_acquire(&loaded_cache->cache_entry_lock);
+        cache_lock_acquire(&loaded_cache->cache_entry_lock);
 
         return loaded_cache;
     } else {
-        /* Keep track of old sector, for writing to disk. */
-        int old_sector = cache->sector;
-
         /* Still need to load it; mark it here so that everyone
            blocks on it. */
-        cache->sector = sector;
+        cache_seq_bump(cache);
+        cache_index_set(cache, sector);
 
         /* Now that everyone knows where the sector will be loaded, we can
            release global. Anyone trying to access this (half-loaded) sector
-           will block until we release the lock later. We also mark it in
-           our LRU cache, to keep everything in sync. */
-        lru_enqueue(sector);
+           will block until we release the lock later. We also hand it to
+           the replacement policy, to keep everything in sync. */
+        cache_track(cache, cache_class_region(class));
         lock_release(&cache_table_lock);
+        cache_stat_inc(&cache_stats[cache->class].evictions);
 
-        /* Read in new memory, write out old (if it's dirty). */
-        if (cache->dirty) {
-            /* Occassionally, need to flush stored files when a thread closes. This
-               requires enabling interrupts. */
-            enum intr_level old_level = intr_enable();
-            block_write(fs_device, old_sector, &cache->data);
-            intr_set_level(old_level);
-        }
-        cache->dirty = false;
         cache->access = false;
         cache->mode = UNLOCK;
-        // TODO : review memset policy
-        // memset(&cache->data, 0, BLOCK_SECTOR_SIZE);
-        if (!writing) {
-            block_read(fs_device, sector, cache->data); 
-        }
+        cache_fill(cache, fill, class);
         return cache;
     }
 }
 
-/* Called when filesystem is closed. We want to write all dirty block to disk.*/
-void flush_cache(void) {
-    struct cache_entry *cache = NULL;
+/* Returns the region of the cache that sectors holding CLASS of data
+   belong in. */
+static enum cache_region cache_class_region(enum cache_class class) {
+    return class == CACHE_DATA ? CACHE_REGION_DATA : CACHE_REGION_META;
+}
+
+/* Hands CACHE, just filled, to the replacement policy, counting it
+   against REGION. */
+static void cache_track(struct cache_entry *cache, enum cache_region region) {
+    ASSERT(lock_held_by_current_thread(&cache_table_lock));
+    ASSERT(region < CACHE_REGION_CNT);
+
+    cache->region = region;
+    cache_region_cnt[region]++;
+    cache_policy->insert(cache);
+    cache_wake_evictors();
+}
+
+/* Gives CACHE, picked as a victim but not evicted after all, back to the
+   replacement policy in its old region. Unlike cache_track(), this isn't
+   a new use of the sector. */
+static void cache_restore(struct cache_entry *cache) {
+    ASSERT(lock_held_by_current_thread(&cache_table_lock));
+    ASSERT(cache->region < CACHE_REGION_CNT);
+
+    cache_region_cnt[cache->region]++;
+    cache_policy->restore(cache);
+}
+
+/* Has the replacement policy pick a victim to make room for a sector
+   holding CLASS of data. The other region only gives up an entry while
+   it holds more than its share, so that a stream of one kind of sector
+   can't crowd out the other; but metadata waiting for the journal is
+   passed over for any other entry. Returns NULL if nothing can be
+   evicted. */
+static struct cache_entry *cache_pick_victim(enum cache_class class) {
+    ASSERT(lock_held_by_current_thread(&cache_table_lock));
+
+    enum cache_region mine = cache_class_region(class);
+    enum cache_region other = mine == CACHE_REGION_DATA ? CACHE_REGION_META
+                                                        : CACHE_REGION_DATA;
+    enum cache_region from = CACHE_REGION_ANY;
+    if (cache_region_cnt[other] <= cache_region_share[other]
+        && cache_region_cnt[mine] > 0) {
+        from = mine;
+    }
+
+    struct cache_entry *cache = cache_policy->evict(from);
+
+    /* Entries left to the journal can't be written back until it commits,
+       so look past them, anywhere in the cache. Their flag is only a hint
+       without their locks; cache_evict() checks it again. */
+    for (size_t tries = 0; cache != NULL && cache->journal
+         && tries < cache_size; tries++) {
+        cache_policy->restore(cache);
+        cache = cache_policy->evict(CACHE_REGION_ANY);
+    }
+
+    if (cache != NULL) {
+        cache_region_cnt[cache->region]--;
+    }
+    return cache;
+}
+
+/* Marks CACHE, which the caller has locked, as dirty. If OWNER is not
+   null, the entry now belongs to it; otherwise it keeps any owner it
+   already has. Metadata is left to the journal, if it's in use, and
+   charged to the current thread's handle, unless it was newly allocated
+   since the last commit. */
+static void cache_mark_dirty(struct cache_entry *cache,
+                             struct cache_owner *owner) {
+    ASSERT(lock_held_by_current_thread(&cache->cache_entry_lock));
+
+    bool journal = cache->class != CACHE_DATA && journal_enabled()
+                   && cache->fresh != cache_epoch;
+    bool charge = false;
+    if (cache->dirty && (owner == NULL || cache->owner == owner)
+        && (cache->journal || !journal)) {
+        return;
+    }
+
+    cache_lock_acquire(&dirty_lock);
+    if (!cache->dirty) {
+        cache->dirty = true;
+        list_push_back(&dirty_list, &cache->dirty_elem);
+        dirty_cnt++;
+    }
+    if (journal && !cache->journal) {
+        cache->journal = true;
+        journal_cnt++;
+        charge = true;
+    }
+    if (owner != NULL && cache->owner != owner) {
+        if (cache->owner != NULL) {
+            list_remove(&cache->owner_elem);
+        }
+        cache->owner = owner;
+        list_push_back(&owner->dirty, &cache->owner_elem);
+    }
+    lock_release(&dirty_lock);
+
+    if (charge) {
+        journal_charge();
+    }
+}
+
+/* Marks CACHE, which the caller has locked, as clean. */
+static void cache_mark_clean(struct cache_entry *cache) {
+    ASSERT(lock_held_by_current_thread(&cache->cache_entry_lock));
+
+    if (cache->dirty) {
+        cache_lock_acquire(&dirty_lock);
+        cache->dirty = false;
+        list_remove(&cache->dirty_elem);
+        dirty_cnt--;
+        if (cache->journal) {
+            cache->journal = false;
+            journal_cnt--;
+        }
+        if (cache->owner != NULL) {
+            list_remove(&cache->owner_elem);
+            cache->owner = NULL;
+        }
+        lock_release(&dirty_lock);
+    }
+}
+
+/* Writes CACHE, which the caller has locked, back to disk. */
+static void cache_writeback(struct cache_entry *cache) {
+    ASSERT(lock_held_by_current_thread(&cache->cache_entry_lock));
+    ASSERT(cache->dirty);
+
+    block_write(fs_device, cache->sector, cache->data);
+    cache_mark_clean(cache);
+    cache_stat_inc(&cache_stats[cache->class].writebacks);
+}
+
+/* Orders dirty entries by sector. */
+static int cache_dirty_compare(const void *a_, const void *b_) {
+    const struct cache_dirty *a = a_;
+    const struct cache_dirty *b = b_;
 
-    for (int i = 0; i < CACHE_SIZE; i++) {
-        cache = &sector_cache[i];
+    return (a->sector > b->sector) - (a->sector < b->sector);
+}
+
+/* Writes back every entry that is dirty as of the call, or only those
+   belonging to OWNER if it is not null, in ascending sector order so that
+   the disk head sweeps across once. Those left to the journal are
+   skipped, as are those WANTED, if not null, returns false for. BATCH
+   must have room for cache_size elements. Only one entry is locked at a
+   time, so other threads are held up only on the sector being written.
+   Returns the number of sectors written. */
+static size_t cache_flush(struct cache_dirty *batch,
+                          struct cache_owner *owner,
+                          bool (*wanted) (block_sector_t sector)) {
+    size_t cnt = 0;
+
+    cache_lock_acquire(&dirty_lock);
+    if (owner == NULL) {
+        for (struct list_elem *e = list_begin(&dirty_list);
+             e != list_end(&dirty_list); e = list_next(e)) {
+            struct cache_entry *cache = list_entry(e, struct cache_entry,
+                                                   dirty_elem);
+            batch[cnt].sector = cache->sector;
+            batch[cnt].cache = cache;
+            cnt++;
+        }
+    } else {
+        for (struct list_elem *e = list_begin(&owner->dirty);
+             e != list_end(&owner->dirty); e = list_next(e)) {
+            struct cache_entry *cache = list_entry(e, struct cache_entry,
+                                                   owner_elem);
+            batch[cnt].sector = cache->sector;
+            batch[cnt].cache = cache;
+            cnt++;
+        }
+    }
+    lock_release(&dirty_lock);
+
+    qsort(batch, cnt, sizeof *batch, cache_dirty_compare);
 
-        if (cache->sector == CACHE_SECTOR_EMPTY) {
+    size_t written = 0;
+    for (size_t i = 0; i < cnt; i++) {
+        struct cache_entry *cache = batch[i].cache;
+
+        if (wanted != NULL && !wanted(batch[i].sector)) {
             continue;
         }
+        cache_lock_acquire(&cache->cache_entry_lock);
+
+        /* May have been written out or evicted while we waited. One that
+           is pinned for writing will be dirtied again when it's unpinned,
+           so leave it until then. */
+        if (cache->dirty && cache->sector == batch[i].sector
+            && cache->mode != WRITE_LOCK && !cache->journal) {
+            cache_writeback(cache);
+            written++;
+        }
+        lock_release(&cache->cache_entry_lock);
+    }
 
-        if (cache->dirty) {
-            /* Occassionally, need to flush stored files when a thread closes. This
-               requires enabling interrupts. */
-            enum intr_level old_level = intr_enable();
+    return written;
+}
 
-            lock_acquire(&cache->cache_entry_lock);
-            block_write(fs_device, cache->sector, &cache->data);
-            cache->dirty = false;
-            lock_release(&cache->cache_entry_lock);
+/* Called when filesystem is closed, and before each journal commit. We want
+   to write all dirty block to disk, bar those the journal writes. */
+void flush_cache(void) {
+    struct cache_dirty *batch = malloc(cache_size * sizeof *batch);
+    if (batch == NULL) {
+        PANIC("Couldn't allocate buffer cache flush batch.");
+    }
+
+    /* Occassionally, need to flush stored files when a thread closes. This
+       requires enabling interrupts. */
+    enum intr_level old_level = intr_enable();
+    cache_flush(batch, NULL, NULL);
+    intr_set_level(old_level);
+
+    free(batch);
+}
+
+/* Writes back the dirty sectors, bar those the journal writes, for which
+   WANTED returns true. It is called without any of the cache's locks
+   held. */
+void cache_flush_if(bool (*wanted) (block_sector_t sector)) {
+    struct cache_dirty *batch = malloc(cache_size * sizeof *batch);
+    if (batch == NULL) {
+        PANIC("Couldn't allocate buffer cache flush batch.");
+    }
+
+    cache_flush(batch, NULL, wanted);
+    free(batch);
+}
+
+/* Returns the most sectors a reader should have prefetched ahead of it,
+   so that they're still cached when it gets to them. Under 2Q, they wait
+   on probation, and half of it is left to them; under LRU, they compete
+   with the whole cache, and a quarter of that is. */
+size_t cache_read_ahead_max(void) {
+    size_t room = cache_policy == &twoq_policy
+                  ? cache_size / CACHE_2Q_PROBATION_RATIO : cache_size / 2;
+    return room / 2;
+}
+
+/* Returns the number of sectors the cache holds. */
+size_t cache_get_size(void) {
+    return cache_size;
+}
 
-            intr_set_level(old_level);
+/* Returns the number of dirty sectors left for the journal to write. */
+size_t cache_journal_count(void) {
+    return journal_cnt;
+}
+
+/* Copies up to MAX of the dirty sectors left for the journal, in
+   ascending order, into BUFFER, BLOCK_SECTOR_SIZE bytes apiece, and
+   stores their numbers in SECTORS. Returns the number copied. The
+   journal must keep them from changing until it's done with them, and
+   calls this once per commit, after writing back the rest of the
+   cache. */
+size_t cache_journal_collect(block_sector_t *sectors, void *buffer_,
+                             size_t max) {
+    uint8_t *buffer = buffer_;
+    struct cache_dirty *batch = malloc(cache_size * sizeof *batch);
+    size_t cnt = 0;
+
+    /* What was allocated before now is reachable once this commits. */
+    cache_epoch++;
+
+    if (batch == NULL) {
+        return 0;
+    }
+
+    cache_lock_acquire(&dirty_lock);
+    for (struct list_elem *e = list_begin(&dirty_list);
+         e != list_end(&dirty_list); e = list_next(e)) {
+        struct cache_entry *cache = list_entry(e, struct cache_entry,
+                                               dirty_elem);
+        if (cache->journal) {
+            batch[cnt].sector = cache->sector;
+            batch[cnt].cache = cache;
+            cnt++;
         }
     }
+    lock_release(&dirty_lock);
+
+    qsort(batch, cnt, sizeof *batch, cache_dirty_compare);
+
+    size_t copied = 0;
+    for (size_t i = 0; i < cnt && copied < max; i++) {
+        struct cache_entry *cache = batch[i].cache;
+
+        cache_lock_acquire(&cache->cache_entry_lock);
+        if (cache->journal && cache->sector == batch[i].sector) {
+            ASSERT(cache->mode != WRITE_LOCK);
+            memcpy(buffer + copied * BLOCK_SECTOR_SIZE, cache->data,
+                   BLOCK_SECTOR_SIZE);
+            sectors[copied++] = cache->sector;
+        }
+        lock_release(&cache->cache_entry_lock);
+    }
+
+    free(batch);
+    return copied;
 }
 
-/* Reads data into cache, but not into buffer. */
-static void read_ahead(void *arg_ UNUSED) {
-    struct cache_entry *cache = NULL;
-    int i = 0;
+/* Marks the CNT SECTORS that cache_journal_collect() copied clean, now
+   that the journal has written them back. */
+void cache_journal_done(const block_sector_t *sectors, size_t cnt) {
+    for (size_t i = 0; i < cnt; i++) {
+        struct cache_entry *cache = sector_to_cache(sectors[i]);
+        if (cache == NULL) {
+            continue;
+        }
 
-    while (1) {
-        lock_acquire(&cache_table_lock);
-        ASSERT(list_size(&cache_lru) <= CACHE_SIZE);
+        cache_lock_acquire(&cache->cache_entry_lock);
+        if (cache->journal && cache->sector == (int) sectors[i]) {
+            cache_mark_clean(cache);
+            cache_stat_inc(&cache_stats[cache->class].writebacks);
+            cache_wake_evictors();
+        }
+        lock_release(&cache->cache_entry_lock);
+    }
+}
 
-        for (i = read_ahead_head; i != read_ahead_tail; 
-             i = (i + 1) % CACHE_SIZE) {
-            /* Acquire global lock and cache entry. */
-            cache = sector_to_cache(read_ahead_buffer[i]);
+/* Initializes OWNER, which has no dirty sectors yet. */
+void cache_owner_init(struct cache_owner *owner) {
+    list_init(&owner->dirty);
+}
 
-            /* Sector is not currently in cache- switch it in. */
-            if (!cache) {
-                ASSERT(list_size(&cache_lru) <= CACHE_SIZE);
-                cache = get_free_cache(i, false);
+/* Forgets that any sectors belong to OWNER, which is about to go away.
+   They stay dirty, for write behind to take care of. */
+void cache_owner_release(struct cache_owner *owner) {
+    cache_lock_acquire(&dirty_lock);
+    while (!list_empty(&owner->dirty)) {
+        struct cache_entry *cache = list_entry(list_pop_front(&owner->dirty),
+                                               struct cache_entry, owner_elem);
+        cache->owner = NULL;
+    }
+    lock_release(&dirty_lock);
+}
+
+/* Writes back the sectors that are dirty on behalf of OWNER as of the
+   call, in ascending order, leaving the rest of the cache alone. Returns
+   false if memory for doing so couldn't be allocated. */
+bool cache_owner_flush(struct cache_owner *owner) {
+    ASSERT(owner != NULL);
+
+    struct cache_dirty *batch = malloc(cache_size * sizeof *batch);
+    if (batch == NULL) {
+        return false;
+    }
+
+    cache_flush(batch, owner, NULL);
+    free(batch);
+    return true;
+}
 
-                /* Really shouldn't be null. */
-                ASSERT(cache);
+/* Queues SECTOR to be read into the cache by the read_ahead thread, unless
+   it's already cached. SECTOR holds CLASS of data. Never blocks on I/O; if
+   the queue is full the request is dropped. */
+void cache_prefetch(block_sector_t sector, enum cache_class class) {
+    ASSERT((int) sector != CACHE_SECTOR_EMPTY);
+
+    if (sector_to_cache(sector)) {
+        return;
+    }
 
-                /* Should've switched locks. */
+    cache_lock_acquire(&read_ahead_lock);
+    if (read_ahead_cnt < CACHE_READ_AHEAD_QUEUE) {
+        struct read_ahead_request *request = &read_ahead_queue[
+            (read_ahead_head + read_ahead_cnt++) % CACHE_READ_AHEAD_QUEUE];
+        request->sector = sector;
+        request->class = class;
+        cond_signal(&read_ahead_nonempty, &read_ahead_lock);
+    }
+    lock_release(&read_ahead_lock);
+}
+
+/* Fills queued sectors into the cache, sleeping until there are some. */
+static void read_ahead(void *arg_ UNUSED) {
+    while (1) {
+        cache_lock_acquire(&read_ahead_lock);
+        while (read_ahead_cnt == 0) {
+            cond_wait(&read_ahead_nonempty, &read_ahead_lock);
+        }
+        struct read_ahead_request request = read_ahead_queue[read_ahead_head];
+        read_ahead_head = (read_ahead_head + 1) % CACHE_READ_AHEAD_QUEUE;
+        read_ahead_cnt--;
+        lock_release(&read_ahead_lock);
+
+        /* Sector is not currently in cache- switch it in. If someone else
+           beat us to it, or everything got evicted ahead of us, there's
+           nothing more to do. */
+        if (!sector_to_cache(request.sector)) {
+            struct cache_entry *cache = get_free_cache(request.sector,
+                CACHE_FILL_PREFETCH, request.class);
+
+            /* We done, we release. */
+            if (cache) {
                 ASSERT(!lock_held_by_current_thread(&cache_table_lock));
-                ASSERT(lock_held_by_current_thread(&cache->cache_entry_lock));
-                
-                /* We done, we release. */
                 lock_release(&cache->cache_entry_lock);
-                lock_acquire(&cache_table_lock);
             }
         }
-        read_ahead_head = read_ahead_tail;
-        lock_release(&cache_table_lock);
-        timer_msleep(CACHE_KERNEL_SLEEP);
     }
 }
 
+/* Returns how long write_behind should wait between flushes: the longest
+   interval when nothing is dirty, shrinking linearly to the shortest at
+   the high-water mark. */
+static int64_t write_behind_interval(void) {
+    size_t high_water = cache_size / CACHE_DIRTY_HIGH_WATER_RATIO;
+    size_t dirty = dirty_cnt < high_water ? dirty_cnt : high_water;
+
+    return CACHE_FLUSH_MAX_MS -
+        (int64_t) (CACHE_FLUSH_MAX_MS - CACHE_FLUSH_MIN_MS) * dirty /
+        high_water;
+}
+
+/* Flushes dirty entries periodically, committing the metadata among them
+   to the journal in groups. Sleeps in short slices so that it notices,
+   soon after, the dirty ratio growing or crossing the high-water mark. */
 static void write_behind(void *arg_ UNUSED) {
-    struct cache_entry *cache = NULL;
+    struct cache_dirty *batch = malloc(cache_size * sizeof *batch);
+    if (batch == NULL) {
+        PANIC("Couldn't allocate buffer cache flush batch.");
+    }
 
-    int i = 0;
     while (1) {
-        lock_acquire(&cache_table_lock);
-        for (i = 0; i < CACHE_SIZE; i++) {
-            cache = &sector_cache[i];
-            if (cache->dirty) {
-                lock_acquire(&cache->cache_entry_lock);
-                block_write(fs_device, cache->sector, &cache->data);
-                cache->dirty = false;
-                lock_release(&cache->cache_entry_lock);
-            }
+        int64_t slept = 0;
+        while (slept < write_behind_interval() &&
+               dirty_cnt < cache_size / CACHE_DIRTY_HIGH_WATER_RATIO) {
+            timer_msleep(CACHE_FLUSH_MIN_MS);
+            slept += CACHE_FLUSH_MIN_MS;
         }
-        lock_release(&cache_table_lock);
-        timer_msleep(CACHE_KERNEL_SLEEP);
+
+        /* Data first, then whatever metadata has piled up since the last
+           commit, as one transaction. */
+        cache_flush(batch, NULL, NULL);
+        journal_commit();
     }
 }
 
-static void lru_enqueue(block_sector_t sector) {
-    /* Any modification to LRU should be done in lockstep with
-       modification to cache. */
-    ASSERT(lock_held_by_current_thread(&cache_table_lock));
-    ASSERT(list_size(&cache_lru) < CACHE_SIZE);
+/* Acquires LOCK, recording how long it took if it was contended. */
+static void cache_lock_acquire(struct lock *lock) {
+    if (lock_try_acquire(lock)) {
+        return;
+    }
+
+    int64_t start = timer_ticks();
+    lock_acquire(lock);
+
+    enum intr_level old_level = intr_disable();
+    cache_lock_waits++;
+    cache_lock_wait_ticks += timer_ticks() - start;
+    intr_set_level(old_level);
+}
+
+/* Bumps a statistics counter. Counters are bumped by threads holding
+   unrelated locks, so they're kept consistent by disabling interrupts. */
+static void cache_stat_inc(unsigned *counter) {
+    enum intr_level old_level = intr_disable();
+    (*counter)++;
+    intr_set_level(old_level);
+}
+
+/* Copies the current statistics into STATS. */
+void cache_get_stats(struct fsstat *stats) {
+    unsigned long long reads, writes;
+    block_get_stats(fs_device, &reads, &writes);
+
+    enum intr_level old_level = intr_disable();
+    for (int i = 0; i < CACHE_CLASS_CNT; i++) {
+        stats->cache[i] = cache_stats[i];
+    }
+    stats->optimistic_reads = cache_optimistic_reads;
+    stats->optimistic_retries = cache_optimistic_retries;
+    stats->lock_waits = cache_lock_waits;
+    stats->lock_wait_ticks = cache_lock_wait_ticks;
+    intr_set_level(old_level);
+
+    stats->sectors_read = reads;
+    stats->sectors_written = writes;
+}
+
+/* Prints buffer cache statistics. */
+void cache_print_stats(void) {
+    static const char *class_names[CACHE_CLASS_CNT] = {
+        "data", "metadata", "index"
+    };
+    struct fsstat stats;
+    cache_get_stats(&stats);
+
+    printf("Buffer cache (%s, %zu sectors, %zu reserved for metadata):\n",
+           cache_policy->name, cache_size,
+           cache_region_share[CACHE_REGION_META]);
+    for (int i = 0; i < CACHE_CLASS_CNT; i++) {
+        const struct cache_stats *c = &stats.cache[i];
+        unsigned lookups = c->hits + c->misses;
+        printf("  %s: %u hits, %u misses (%u%% hit rate), %u evictions, "
+               "%u writebacks, %u of %u read-ahead used\n", class_names[i],
+               c->hits, c->misses, lookups ? c->hits * 100 / lookups : 0,
+               c->evictions, c->writebacks, c->read_ahead_used,
+               c->read_ahead_issued);
+    }
+    printf("  %u optimistic reads, %u retried under lock\n",
+           stats.optimistic_reads, stats.optimistic_retries);
+    printf("  %u lock waits, %"PRId64" ticks waiting\n", stats.lock_waits,
+           stats.lock_wait_ticks);
+}
+
+/* Sets aside PERCENT percent of the cache for metadata. Must be called
+   before cache_init(). Returns false if PERCENT is out of range. */
+bool cache_set_meta_percent(int percent) {
+    if (percent < 0 || percent > 100) {
+        return false;
+    }
+    cache_meta_percent = percent;
+    return true;
+}
+
+/* Selects the replacement policy named NAME. Must be called before
+   cache_init(). Returns false if there is no such policy. */
+bool cache_set_policy(const char *name) {
+    for (size_t i = 0; i < sizeof cache_policies / sizeof *cache_policies;
+         i++) {
+        if (!strcmp(name, cache_policies[i]->name)) {
+            cache_policy = cache_policies[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+/* LRU approximated by second chance: entries are kept in fill order,
+   and an entry accessed since it was last considered goes to the back
+   instead of being evicted. */
 
-    /* Keep new entry on LRU queue. */
-    struct lru_entry *new = malloc(sizeof(struct lru_entry));
-    new->sector = sector;
+/* Queue of cached entries, least recently filled first. */
+static struct list lru_queue;
 
-    list_push_back(&cache_lru, &new->elem);
+static void lru_init(void) {
+    list_init(&lru_queue);
 }
 
-static struct cache_entry *lru_evict(void) {
-    /* Any modification to LRU should be done in lockstep with
-       modification to cache. */
+static void lru_insert(struct cache_entry *cache) {
     ASSERT(lock_held_by_current_thread(&cache_table_lock));
-    ASSERT(list_size(&cache_lru) <= CACHE_SIZE);
+    ASSERT(cache->queue == CACHE_QUEUE_NONE);
+
+    cache->queue = CACHE_QUEUE_PROTECTED;
+    list_push_back(&lru_queue, &cache->policy_elem);
+}
+
+static struct cache_entry *lru_evict(enum cache_region region) {
+    ASSERT(lock_held_by_current_thread(&cache_table_lock));
+
+    struct cache_entry *cache = queue_evict(&lru_queue, region, true);
+    if (cache != NULL) {
+        cache->queue = CACHE_QUEUE_NONE;
+    }
+    return cache;
+}
+
+static void lru_restore(struct cache_entry *cache) {
+    lru_insert(cache);
+}
+
+/* Removes and returns the first entry of QUEUE in REGION, or NULL if
+   there is none. If SECOND_CHANCE, an entry accessed since it was last
+   considered goes to the back instead, with its access bit cleared.
+   Entries of other regions keep their places at the front. */
+static struct cache_entry *queue_evict(struct list *queue,
+                                       enum cache_region region,
+                                       bool second_chance) {
+    struct list skipped;
+    list_init(&skipped);
+
+    struct cache_entry *victim = NULL;
+    while (victim == NULL && !list_empty(queue)) {
+        struct cache_entry *cache = list_entry(list_pop_front(queue),
+            struct cache_entry, policy_elem);
+
+        if (region != CACHE_REGION_ANY && cache->region != region) {
+            list_push_back(&skipped, &cache->policy_elem);
+        } else if (second_chance && cache->access) {
+            /* Critical to reset access flag; otherwise, this loop will
+               continue infinitely. */
+            cache->access = false;
+            list_push_back(queue, &cache->policy_elem);
+        } else {
+            victim = cache;
+        }
+    }
 
-    /* Update queue by access time. */
-    lru_update();
+    if (!list_empty(&skipped)) {
+        list_splice(list_begin(queue), list_begin(&skipped),
+                    list_end(&skipped));
+    }
+    return victim;
+}
+
+/* 2Q (Johnson and Shasha). A newly filled sector goes into the probation
+   FIFO, and is evicted from there without regard to how often it was
+   used, leaving its sector number behind in a ghost queue. A sector that
+   misses again while its ghost is remembered has shown real reuse, and
+   goes into the protected queue, which is managed like lru above. A
+   single pass over a large file thus only ever churns the probation
+   queue. */
+
+/* Remembered sector numbers of entries recently evicted from probation.
+   Kept in a ring, indexed by sector. */
+struct twoq_ghost {
+    int sector;                     /* Sector, or CACHE_SECTOR_EMPTY. */
+    struct hash_elem elem;          /* Element in twoq_ghost_index. */
+};
+
+static struct list twoq_probation;
+static struct list twoq_protected;
+static size_t twoq_probation_cnt;
+
+static struct twoq_ghost *twoq_ghosts;
+static size_t twoq_ghost_cnt;
+static size_t twoq_ghost_next;
+static struct hash twoq_ghost_index;
+
+/* Hashes a ghost by its sector number. */
+static unsigned twoq_ghost_hash(const struct hash_elem *e, void *aux UNUSED) {
+    return hash_int(hash_entry(e, struct twoq_ghost, elem)->sector);
+}
+
+/* Orders ghosts by sector number. */
+static bool twoq_ghost_less(const struct hash_elem *a,
+                            const struct hash_elem *b, void *aux UNUSED) {
+    return hash_entry(a, struct twoq_ghost, elem)->sector <
+           hash_entry(b, struct twoq_ghost, elem)->sector;
+}
 
-    /* Get least recently used. It is *possible*, although exceedingly
-       unlikely, that concurrency would cause all pages to be evicted
-       ahead of us without any replacements. In such cases, we return
-       NULL and re-run through our while loop. */
-    if (list_size(&cache_lru) > 0) {
-        struct list_elem *e = list_pop_front(&cache_lru);
-        struct lru_entry *old = list_entry(e, struct lru_entry, elem);
+static void twoq_init(void) {
+    list_init(&twoq_probation);
+    list_init(&twoq_protected);
+    twoq_probation_cnt = 0;
+
+    /* The paper recommends remembering half as many ghosts as the cache
+       holds sectors. */
+    twoq_ghost_cnt = cache_size / 2;
+    twoq_ghost_next = 0;
+    twoq_ghosts = malloc(twoq_ghost_cnt * sizeof *twoq_ghosts);
+    if (twoq_ghosts == NULL ||
+        !hash_init(&twoq_ghost_index, twoq_ghost_hash, twoq_ghost_less,
+                   NULL)) {
+        PANIC("Couldn't allocate 2Q ghost queue.");
+    }
+    for (size_t i = 0; i < twoq_ghost_cnt; i++) {
+        twoq_ghosts[i].sector = CACHE_SECTOR_EMPTY;
+    }
+}
 
-        block_sector_t sector = old->sector;
-        free(old);
+static void twoq_insert(struct cache_entry *cache) {
+    ASSERT(lock_held_by_current_thread(&cache_table_lock));
+    ASSERT(cache->queue == CACHE_QUEUE_NONE);
 
-        /* Our entry ought to be valid. */
-        ASSERT(sector_to_cache(sector));
+    struct twoq_ghost key;
+    key.sector = cache->sector;
+    struct hash_elem *e = hash_delete(&twoq_ghost_index, &key.elem);
 
-        return sector_to_cache(sector); 
+    if (e != NULL) {
+        /* Seen recently; forget the ghost and protect the entry. */
+        hash_entry(e, struct twoq_ghost, elem)->sector = CACHE_SECTOR_EMPTY;
+        cache->queue = CACHE_QUEUE_PROTECTED;
+        list_push_back(&twoq_protected, &cache->policy_elem);
     } else {
-        return NULL;
+        cache->queue = CACHE_QUEUE_PROBATION;
+        list_push_back(&twoq_probation, &cache->policy_elem);
+        twoq_probation_cnt++;
     }
 }
 
-static void lru_update(void) {
-   /* Make sure list has actually been initted. */
-    if (cache_lru.head.next == NULL) {
-        /* Not initted, nothing to do. */
+/* Remembers that SECTOR was recently evicted from probation, forgetting
+   the oldest ghost if need be. */
+static void twoq_remember(int sector) {
+    if (twoq_ghost_cnt == 0) {
         return;
     }
 
-    /* If list isn't full, also no reason to updated. */
-    if (list_size(&cache_lru) < CACHE_SIZE) {
-        return;
+    struct twoq_ghost *ghost = &twoq_ghosts[twoq_ghost_next];
+    twoq_ghost_next = (twoq_ghost_next + 1) % twoq_ghost_cnt;
+
+    if (ghost->sector != CACHE_SECTOR_EMPTY) {
+        hash_delete(&twoq_ghost_index, &ghost->elem);
     }
+    ghost->sector = sector;
+    if (hash_insert(&twoq_ghost_index, &ghost->elem) != NULL) {
+        /* Already remembered; keep the older ghost. */
+        ghost->sector = CACHE_SECTOR_EMPTY;
+    }
+}
 
-    /* If we already hold the lock, we're probably doing something
-       with the cache table. Skip. */
-    if (lock_held_by_current_thread(&cache_table_lock)) {
-        return;
+/* Evicts the oldest entry in REGION from probation, remembering its
+   ghost. Returns NULL if there is none. */
+static struct cache_entry *twoq_evict_probation(enum cache_region region) {
+    struct cache_entry *cache = queue_evict(&twoq_probation, region, false);
+    if (cache != NULL) {
+        twoq_probation_cnt--;
+        cache->queue = CACHE_QUEUE_NONE;
+        cache->access = false;
+        twoq_remember(cache->sector);
     }
+    return cache;
+}
 
-    /* Only update here if we can acquire the lock; otherwise, potential
-       for weird behavior. Don't actually acquire the lock though, because
-       that's a weird thing to do in an interrupt. */
-    if (lock_try_acquire(&cache_table_lock)) {
-        ASSERT(list_size(&cache_lru) <= CACHE_SIZE);
-
-        /* Move all frames that have been accessed to the back of the queue. */
-        struct list_elem *e;
-        struct list_elem *e_prev;
-
-        /* Start at front of list, go to back. This preserves relative ordering of
-           frames. Reset accessed bit along the way. */
-        e = list_begin(&cache_lru);
-        ASSERT(e);
-        while (e != list_end(&cache_lru)) {
-            struct lru_entry *ce = list_entry(e, struct lru_entry, elem);
-
-            e_prev = e;
-            e = list_next(e);
-            
-            /* If accessed, reset access flag and set to back. */
-            if (sector_to_cache(ce->sector)->access) {
-
-                /* Critical to reset access flag; otherwise, this loop will 
-                   continue inifinitely. */
-                sector_to_cache(ce->sector)->access = false;
-
-                /* Move to back of list. */
-                list_remove(e_prev);
-                list_push_back(&cache_lru, e_prev);
-            }
-        }
+static struct cache_entry *twoq_evict(enum cache_region region) {
+    ASSERT(lock_held_by_current_thread(&cache_table_lock));
 
-        lock_release(&cache_table_lock);
+    /* Evict from probation while it holds more than its share of the cache,
+       or when there's nothing else to evict. */
+    struct cache_entry *cache = NULL;
+    if (twoq_probation_cnt > cache_size / CACHE_2Q_PROBATION_RATIO) {
+        cache = twoq_evict_probation(region);
+    }
+    if (cache == NULL) {
+        cache = queue_evict(&twoq_protected, region, true);
+        if (cache != NULL) {
+            cache->queue = CACHE_QUEUE_NONE;
+        }
+    }
+    if (cache == NULL) {
+        cache = twoq_evict_probation(region);
     }
+    return cache;
 }
 
+/* A victim taken from probation left a ghost behind, which twoq_insert()
+   would mistake for reuse; forget it and put the entry back on
+   probation. Any other victim came from the protected queue. */
+static void twoq_restore(struct cache_entry *cache) {
+    ASSERT(lock_held_by_current_thread(&cache_table_lock));
+    ASSERT(cache->queue == CACHE_QUEUE_NONE);
+
+    struct twoq_ghost key;
+    key.sector = cache->sector;
+    struct hash_elem *e = hash_delete(&twoq_ghost_index, &key.elem);
+
+    if (e != NULL) {
+        hash_entry(e, struct twoq_ghost, elem)->sector = CACHE_SECTOR_EMPTY;
+        cache->queue = CACHE_QUEUE_PROBATION;
+        list_push_back(&twoq_probation, &cache->policy_elem);
+        twoq_probation_cnt++;
+    } else {
+        cache->queue = CACHE_QUEUE_PROTECTED;
+        list_push_back(&twoq_protected, &cache->policy_elem);
+    }
+}
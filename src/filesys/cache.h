@@ -6,6 +6,7 @@
 #define FILESYS_CACHE_H
 
 #include <debug.h>
+#include <fsstat.h>
 #include <stdint.h>
 #include <kernel/hash.h>
 
@@ -15,12 +16,32 @@
 #include "threads/synch.h"
 
 
-/* Number of sectors in buffer cache. */
+/* Default number of sectors in buffer cache; see the -cache option. */
 #define CACHE_SIZE 64
+#define CACHE_MIN_SIZE 48
 #define CACHE_SECTOR_EMPTY -1
 
-/* Sleep time for read ahead and write behind.*/
-#define CACHE_KERNEL_SLEEP 250
+/* Number of independently locked stripes of the sector index. Must be a
+   power of two. */
+#define CACHE_STRIPES 16
+
+/* Default percentage of the cache set aside for metadata; see the
+   -cache-meta option. */
+#define CACHE_META_PERCENT 25
+
+/* The 2Q policy keeps at most 1/CACHE_2Q_PROBATION_RATIO of the cache on
+   probation. */
+#define CACHE_2Q_PROBATION_RATIO 4
+
+/* Write behind flushes every CACHE_FLUSH_MAX_MS when the cache is clean,
+   down to every CACHE_FLUSH_MIN_MS once 1/CACHE_DIRTY_HIGH_WATER_RATIO of
+   it is dirty. */
+#define CACHE_FLUSH_MIN_MS 50
+#define CACHE_FLUSH_MAX_MS 1000
+#define CACHE_DIRTY_HIGH_WATER_RATIO 2
+
+/* Sectors that may be queued for read-ahead at once. */
+#define CACHE_READ_AHEAD_QUEUE 64
 
 enum lock_mode {
     UNLOCK,                         /* No one occupies lock. */
@@ -28,17 +49,52 @@ enum lock_mode {
     WRITE_LOCK                      /* Writer occupies lock. */
 };
 
-struct lru_entry {
-    block_sector_t sector;          /* Sector number. */
+/* Largest number of segments whose misses cache_read_range() and
+   cache_write_range() fill together. */
+#define CACHE_RANGE_BATCH 32
+
+/* Regions of the cache. Each is guaranteed its share of the cache when it
+   needs it, and may borrow whatever the other leaves unused. */
+enum cache_region {
+    CACHE_REGION_DATA,              /* File data. */
+    CACHE_REGION_META,              /* Everything else. */
+    CACHE_REGION_CNT,               /* Number of regions. */
+    CACHE_REGION_ANY = CACHE_REGION_CNT /* Either, when evicting. */
+};
+
+/* Replacement policy queue an entry is on. */
+enum cache_queue {
+    CACHE_QUEUE_NONE,               /* Not tracked by the policy. */
+    CACHE_QUEUE_PROBATION,          /* Seen once recently. */
+    CACHE_QUEUE_PROTECTED           /* Seen repeatedly. */
+};
 
-    struct list_elem elem;          /* Required for list. */
+/* Dirty sectors written on behalf of one file, so that they can be written
+   back without the rest of the cache. */
+struct cache_owner {
+    struct list dirty;              /* Dirty entries, by owner_elem. */
 };
 
 struct cache_entry {
     volatile int sector;            /* Sector number loaded into cache. */
+    struct hash_elem hash_elem;     /* Element in sector index. */
     bool access;                    /* Has sector been accessed. */
     bool dirty;                     /* Has sector been written to. */
-    char data[BLOCK_SECTOR_SIZE];   /* Actual sector data. */
+    struct list_elem dirty_elem;    /* Element in dirty list, if dirty. */
+    struct cache_owner *owner;      /* File it was dirtied for, if known. */
+    struct list_elem owner_elem;    /* Element in owner's dirty list. */
+    bool journal;                   /* Dirty metadata, which only the
+                                       journal may write back. */
+    unsigned fresh;                 /* cache_epoch it was newly allocated
+                                       in, or 0. */
+    bool prefetched;                /* Read ahead and not yet used. */
+    enum cache_class class;         /* Kind of sector, for statistics. */
+    uint8_t *data;                  /* Actual sector data. */
+
+    /* Replacement policy. */
+    struct list_elem policy_elem;   /* Element in policy queue. */
+    enum cache_queue queue;         /* Which queue policy_elem is on. */
+    enum cache_region region;       /* Region it counts against. */
 
     /* Implement read/write lock. */
     struct lock cache_entry_lock;
@@ -53,15 +109,53 @@ struct cache_entry {
     uint8_t writer_waiting;         /* Threads waiting to write. */
 
     enum lock_mode mode;            /* Who currently holds lock. */
+
+    /* Sequence lock for optimistic readers: odd while the sector or its
+       data is being changed, and bumped again once the change is done. */
+    volatile unsigned seq;
+};
+
+/* Part of one sector, for range reads and writes. */
+struct cache_segment {
+    block_sector_t sector;          /* Sector. */
+    off_t offset;                   /* First byte within sector. */
+    off_t size;                     /* Number of bytes. */
 };
 
-void cache_init(void);
+bool cache_set_policy(const char *name);
+bool cache_set_meta_percent(int percent);
+void cache_init(size_t sectors);
 void cache_kernel_thread_init(void);
 void cache_read(block_sector_t sector, void * buffer, off_t size, 
-    off_t offset);
+    off_t offset, enum cache_class class);
 void cache_write(block_sector_t sector, const void * buffer, off_t size, 
-    off_t offset);
+    off_t offset, enum cache_class class, struct cache_owner *owner);
+void cache_zero(block_sector_t sector, enum cache_class class,
+    struct cache_owner *owner);
+void cache_write_new(block_sector_t sector, const void *buffer,
+    enum cache_class class, struct cache_owner *owner);
+void cache_discard(block_sector_t sector);
+void *cache_get(block_sector_t sector, bool write, enum cache_class class,
+    struct cache_owner *owner);
+void cache_put(const void *data);
+void cache_read_range(const struct cache_segment *segs, size_t cnt,
+    void *buffer, enum cache_class class);
+void cache_write_range(const struct cache_segment *segs, size_t cnt,
+    const void *buffer, enum cache_class class, struct cache_owner *owner);
+void cache_prefetch(block_sector_t sector, enum cache_class class);
+size_t cache_read_ahead_max(void);
+void cache_owner_init(struct cache_owner *owner);
+void cache_owner_release(struct cache_owner *owner);
+bool cache_owner_flush(struct cache_owner *owner);
 void flush_cache(void);
+void cache_flush_if(bool (*wanted) (block_sector_t sector));
+size_t cache_get_size(void);
+size_t cache_journal_count(void);
+size_t cache_journal_collect(block_sector_t *sectors, void *buffer,
+    size_t max);
+void cache_journal_done(const block_sector_t *sectors, size_t cnt);
+void cache_get_stats(struct fsstat *stats);
+void cache_print_stats(void);
 
 #endif /* vm/cache.h */
 
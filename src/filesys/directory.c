@@ -1,16 +1,151 @@
 #include "filesys/directory.h"
 #include <stdio.h>
 #include <string.h>
+#include <hash.h>
 #include <list.h>
+#include <round.h>
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
+
+/*! Directory entries in each bucket. */
+#define DIR_BUCKET_ENTRIES (BLOCK_SECTOR_SIZE / sizeof (struct dir_entry))
+
+/*! Most buckets dir_add() probes for a free slot before it grows the
+    directory instead. */
+#define DIR_MAX_PROBE 4
+
+/*! A directory is a hash table of buckets, one per sector of the
+    directory file. An entry's home bucket is hash_string() of its name
+    modulo the number of buckets; if that's full, it goes in the next
+    bucket with room. A lookup thus reads its home bucket, and moves on
+    to the next only if an entry was ever placed past this one. */
+struct dir_bucket {
+    struct dir_entry entries[DIR_BUCKET_ENTRIES];
+    uint32_t spilled;                   /*!< Entries went past it. */
+    uint8_t unused[BLOCK_SECTOR_SIZE
+                   - DIR_BUCKET_ENTRIES * sizeof (struct dir_entry)
+                   - sizeof (uint32_t)];
+};
+
+/*! Slots in the dentry cache. */
+#define DCACHE_SIZE 256
+
+/*! Child sector of a negative dentry. */
+#define DCACHE_NEGATIVE ((block_sector_t) -1)
+
+/*! Dentry cache entry: the result of looking up NAME in the directory
+    whose inode is in sector PARENT, which is the sector of its inode or
+    DCACHE_NEGATIVE if it has no such entry. */
+struct dentry {
+    bool valid;                         /*!< In use? */
+    block_sector_t parent;              /*!< Directory searched. */
+    block_sector_t child;               /*!< What was found. */
+    char name[NAME_MAX + 1];            /*!< Name searched for. */
+};
+
+/*! Dentry cache, direct-mapped by parent and name. */
+static struct dentry dcache[DCACHE_SIZE];
+static struct lock dcache_lock;         /*!< Guards dcache, dcache_gen. */
+static unsigned dcache_gen;             /*!< Bumped by each invalidation. */
+
+static struct dentry *dcache_slot(block_sector_t parent, const char *name);
+static bool dcache_get(block_sector_t parent, const char *name,
+    block_sector_t *childp, unsigned *genp);
+static void dcache_put(block_sector_t parent, const char *name,
+    block_sector_t child, unsigned gen);
+static void dcache_invalidate(block_sector_t parent, const char *name);
+static bool dir_find(struct inode *inode, const char *name,
+    block_sector_t *sectorp);
+static size_t dir_bucket_cnt(const struct dir *dir);
+static void dir_read_bucket(const struct dir *dir, size_t idx,
+    struct dir_bucket *bucket);
+static bool dir_insert(struct dir *dir, const struct dir_entry *e);
+static bool dir_grow(struct dir *dir);
+
+/*! Initializes the directory module. */
+void dir_init(void) {
+    lock_init(&dcache_lock);
+    memset(dcache, 0, sizeof dcache);
+    dcache_gen = 0;
+}
 
+/* Returns the dentry cache slot for NAME in the directory in sector
+   PARENT. */
+static struct dentry *dcache_slot(block_sector_t parent, const char *name) {
+    return &dcache[(hash_string(name) ^ hash_int(parent)) % DCACHE_SIZE];
+}
+
+/* Looks up NAME in the directory in sector PARENT in the dentry cache.
+   On a hit, stores the sector of its inode, or DCACHE_NEGATIVE if it
+   doesn't exist, in *CHILDP and returns true. On a miss, stores in *GENP
+   what dcache_put() needs to tell whether the directory may have changed
+   in the meantime, and returns false. */
+static bool dcache_get(block_sector_t parent, const char *name,
+                       block_sector_t *childp, unsigned *genp) {
+    struct dentry *d = dcache_slot(parent, name);
+    bool hit;
+
+    lock_acquire(&dcache_lock);
+    hit = d->valid && d->parent == parent && !strcmp(d->name, name);
+    if (hit)
+        *childp = d->child;
+    else
+        *genp = dcache_gen;
+    lock_release(&dcache_lock);
+    return hit;
+}
+
+/* Caches CHILD as the result of looking up NAME in the directory in
+   sector PARENT, unless a directory has been changed since the dcache_get()
+   miss that returned GEN, in which case it may be out of date. */
+static void dcache_put(block_sector_t parent, const char *name,
+                       block_sector_t child, unsigned gen) {
+    struct dentry *d = dcache_slot(parent, name);
+
+    lock_acquire(&dcache_lock);
+    if (gen == dcache_gen) {
+        d->valid = true;
+        d->parent = parent;
+        d->child = child;
+        strlcpy(d->name, name, sizeof d->name);
+    }
+    lock_release(&dcache_lock);
+}
+
+/* Drops any cached result of looking up NAME in the directory in sector
+   PARENT, after it has changed. */
+static void dcache_invalidate(block_sector_t parent, const char *name) {
+    struct dentry *d = dcache_slot(parent, name);
+
+    lock_acquire(&dcache_lock);
+    if (d->valid && d->parent == parent && !strcmp(d->name, name))
+        d->valid = false;
+    dcache_gen++;
+    lock_release(&dcache_lock);
+}
 
 /*! Creates a directory with space for ENTRY_CNT entries in the
     given SECTOR.  Returns true if successful, false on failure. */
 bool dir_create(block_sector_t sector, size_t entry_cnt) {
-    return inode_create(sector, entry_cnt * sizeof(struct dir_entry), true);
+    size_t bucket_cnt = DIV_ROUND_UP(entry_cnt, DIR_BUCKET_ENTRIES);
+    return inode_create(sector, bucket_cnt * BLOCK_SECTOR_SIZE, true);
+}
+
+/* Returns the number of buckets in DIR. A partial last sector, as left
+   by creating a directory of a size that isn't a whole number of
+   sectors, is a bucket whose missing entries are free. */
+static size_t dir_bucket_cnt(const struct dir *dir) {
+    return DIV_ROUND_UP(inode_length(dir->inode), BLOCK_SECTOR_SIZE);
+}
+
+/* Reads bucket IDX of DIR into BUCKET. */
+static void dir_read_bucket(const struct dir *dir, size_t idx,
+                            struct dir_bucket *bucket) {
+    memset(bucket, 0, sizeof *bucket);
+    inode_read_at(dir->inode, bucket, sizeof *bucket,
+        idx * BLOCK_SECTOR_SIZE);
 }
 
 /*! Opens and returns the directory for the given INODE, of which
@@ -54,88 +189,220 @@ struct inode * dir_get_inode(struct dir *dir) {
     return dir->inode;
 }
 
+/* Probes DIR's buckets for NAME, as lookup() does, without regard for
+   rehashing. */
+static bool probe(const struct dir *dir, const char *name,
+                  struct dir_entry *ep, off_t *ofsp) {
+    size_t bucket_cnt = dir_bucket_cnt(dir);
+    struct dir_bucket bucket;
+
+    if (bucket_cnt == 0)
+        return false;
+
+    size_t b = hash_string(name) % bucket_cnt;
+    for (size_t i = 0; i < bucket_cnt; i++) {
+        dir_read_bucket(dir, b, &bucket);
+        for (size_t j = 0; j < DIR_BUCKET_ENTRIES; j++) {
+            struct dir_entry *e = &bucket.entries[j];
+            if (e->in_use && !strcmp(name, e->name)) {
+                if (ep != NULL)
+                    *ep = *e;
+                if (ofsp != NULL)
+                    *ofsp = b * BLOCK_SECTOR_SIZE + j * sizeof *e;
+                return true;
+            }
+        }
+        if (!bucket.spilled)
+            break;
+        b = (b + 1) % bucket_cnt;
+    }
+    return false;
+}
+
 /*! Searches DIR for a file with the given NAME.
     If successful, returns true, sets *EP to the directory entry
     if EP is non-null, and sets *OFSP to the byte offset of the
     directory entry if OFSP is non-null.
-    otherwise, returns false and ignores EP and OFSP. */
+    otherwise, returns false and ignores EP and OFSP.
+    A miss while DIR is rehashed by another thread is retried, once the
+    rehash is done. */
 static bool lookup(const struct dir *dir, const char *name,
                    struct dir_entry *ep, off_t *ofsp) {
-    struct dir_entry e;
-    size_t ofs;
+    unsigned seq;
+    bool found;
 
     ASSERT(dir != NULL);
     ASSERT(name != NULL);
 
-    for (ofs = 0; inode_read_at(dir->inode, &e, sizeof(e), ofs) == sizeof(e);
-         ofs += sizeof(e)) {
-        if (e.in_use && !strcmp(name, e.name)) {
-            if (ep != NULL)
-                *ep = e;
-            if (ofsp != NULL)
-                *ofsp = ofs;
-            return true;
+    do {
+        while ((seq = directory_seq(dir->inode)) & 1)
+            directory_wait(dir->inode);
+        found = probe(dir, name, ep, ofsp);
+    } while (!found && directory_seq(dir->inode) != seq);
+    return found;
+}
+
+/* Stores E in a free slot in DIR, in its home bucket or one of the
+   DIR_MAX_PROBE - 1 after it, marking those it passes as spilled.
+   Returns false if none of them has room or a write fails. */
+static bool dir_insert(struct dir *dir, const struct dir_entry *e) {
+    size_t bucket_cnt = dir_bucket_cnt(dir);
+    struct dir_bucket bucket;
+
+    size_t b = bucket_cnt > 0 ? hash_string(e->name) % bucket_cnt : 0;
+    for (size_t i = 0; i < bucket_cnt && i < DIR_MAX_PROBE; i++) {
+        off_t ofs = b * BLOCK_SECTOR_SIZE;
+
+        dir_read_bucket(dir, b, &bucket);
+        for (size_t j = 0; j < DIR_BUCKET_ENTRIES; j++) {
+            if (!bucket.entries[j].in_use) {
+                ofs += j * sizeof *e;
+                return inode_write_at(dir->inode, e, sizeof *e, ofs)
+                       == sizeof *e;
+            }
+        }
+
+        if (!bucket.spilled) {
+            uint32_t spilled = 1;
+            ofs += offsetof(struct dir_bucket, spilled);
+            if (inode_write_at(dir->inode, &spilled, sizeof spilled, ofs)
+                != sizeof spilled)
+                return false;
         }
+        b = (b + 1) % bucket_cnt;
     }
     return false;
 }
 
-/*! Searches DIR for a file with the given PATH and returns true if one exists,
-    false otherwise.  On success, sets *INODE to an inode for the file,
-    otherwise to a null pointer.  The caller must close *INODE. */
-bool dir_lookup(const struct dir *dir, const char *path, struct inode **inode) {
-    /* Recursively find path inside dir until dir is empty. */
-    struct dir_entry e;
+/* Doubles the number of buckets in DIR and rehashes its entries into
+   them. The new table is written to sectors of its own, which replace
+   the old ones all at once. Returns false if there isn't the memory or
+   disk space for it, leaving DIR as it was. */
+static bool dir_grow(struct dir *dir) {
+    size_t old_cnt = dir_bucket_cnt(dir);
+    size_t new_cnt = old_cnt > 0 ? old_cnt * 2 : 1;
+    off_t new_size = new_cnt * BLOCK_SECTOR_SIZE;
+    bool success = false;
 
-    ASSERT(dir != NULL);
-    ASSERT(path != NULL);
+    struct dir_bucket *old = old_cnt > 0 ? malloc(old_cnt * sizeof *old)
+                                         : NULL;
+    struct dir_bucket *new = calloc(new_cnt, sizeof *new);
+    if ((old == NULL && old_cnt > 0) || new == NULL)
+        goto done;
 
-    while (*path == '/') {
-        path++;
+    for (size_t b = 0; b < old_cnt; b++)
+        dir_read_bucket(dir, b, &old[b]);
+
+    /* With twice the room, each entry finds a slot. */
+    for (size_t b = 0; b < old_cnt; b++) {
+        for (size_t j = 0; j < DIR_BUCKET_ENTRIES; j++) {
+            struct dir_entry *e = &old[b].entries[j];
+            if (!e->in_use)
+                continue;
+
+            size_t nb = hash_string(e->name) % new_cnt;
+            for (;;) {
+                struct dir_bucket *bucket = &new[nb];
+                size_t k;
+                for (k = 0; k < DIR_BUCKET_ENTRIES; k++) {
+                    if (!bucket->entries[k].in_use)
+                        break;
+                }
+                if (k < DIR_BUCKET_ENTRIES) {
+                    bucket->entries[k] = *e;
+                    break;
+                }
+                bucket->spilled = 1;
+                nb = (nb + 1) % new_cnt;
+            }
+        }
     }
 
-    /* Found final directory, so return it. */
-    if (*path == '\0') {
-        *inode = dir_get_inode((struct dir *) dir);
-        return true;
-    }
+    directory_seq_bump(dir->inode);
+    success = inode_replace(dir->inode, new, new_size);
+    directory_seq_bump(dir->inode);
 
-    /* Extract the next name in the path (until next '/'). */
-    char *name_end = (char *) path;
-    while ((*name_end != '/') && (*name_end != '\0')) {
-        name_end++;
-    }
-    char *name = malloc(name_end - path + 1);
-    strlcpy(name, path, (name_end - path + 1));
+done:
+    free(old);
+    free(new);
+    return success;
+}
 
+/* Looks up NAME in the directory INODE, through the dentry cache.
+   Returns true and stores the sector of its inode in *SECTORP if it
+   exists, otherwise returns false. */
+static bool dir_find(struct inode *inode, const char *name,
+                     block_sector_t *sectorp) {
+    block_sector_t parent = inode_get_inumber(inode);
+    block_sector_t child;
+    unsigned gen;
+
+    if (!dcache_get(parent, name, &child, &gen)) {
+        struct dir dir = { inode, 0 };
+        struct dir_entry e;
+
+        child = lookup(&dir, name, &e, NULL) ? e.inode_sector
+                                             : DCACHE_NEGATIVE;
+        dcache_put(parent, name, child, gen);
+    }
 
-    /* Could not find name in directory, so return false. */
-    if (!lookup(dir, name, &e, NULL)) {
-        free(name);
+    if (child == DCACHE_NEGATIVE)
         return false;
-    }
+    *sectorp = child;
+    return true;
+}
 
-    free(name);
-    *inode = inode_open(e.inode_sector);
+/*! Searches DIR for a file with the given PATH and returns true if one exists,
+    false otherwise.  On success, sets *INODE to an inode for the file,
+    otherwise to a null pointer.  The caller must close *INODE. */
+bool dir_lookup(const struct dir *dir, const char *path, struct inode **inode) {
+    struct inode *cur;
+    char name[NAME_MAX + 1];
 
-    if (*inode == NULL) {
-        return false;
-    }
+    ASSERT(dir != NULL);
+    ASSERT(path != NULL);
 
-    /* If name is a directory, search it recursively and return result. */
-    if (inode_is_directory(*inode)) {
-        return dir_lookup(dir_open(*inode), name_end, inode);
-    }
+    /* Walk down one name in the path at a time, holding only the inode
+       reached so far open. */
+    *inode = NULL;
+    cur = inode_reopen(dir->inode);
+    for (;;) {
+        while (*path == '/')
+            path++;
+
+        /* Found the end of the path. */
+        if (*path == '\0') {
+            *inode = cur;
+            return true;
+        }
 
-    /* Found final file, so return it. */
-    if (*name_end == '\0') {
-        /* Looking up a file, which is found, so return true. */
-        return true;
+        /* Extract the next name in the path (until next '/'). */
+        size_t len = strcspn(path, "/");
+        if (len > NAME_MAX) {
+            inode_close(cur);
+            return false;
+        }
+        memcpy(name, path, len);
+        name[len] = '\0';
+        path += len;
+
+        block_sector_t sector;
+        bool found = dir_find(cur, name, &sector);
+        inode_close(cur);
+        if (!found)
+            return false;
+
+        cur = inode_open(sector);
+        if (cur == NULL)
+            return false;
+
+        /* Trying to access a path through a file, rather than a
+           directory. */
+        if (!inode_is_directory(cur) && *path != '\0') {
+            inode_close(cur);
+            return false;
+        }
     }
-    
-    /* Else, trying to access a path through a directory that is in fact a 
-    file. */
-    return false;
 }
 
 /*! Adds a file named NAME to DIR, which must not already contain a file by
@@ -145,7 +412,6 @@ bool dir_lookup(const struct dir *dir, const char *path, struct inode **inode) {
     error occurs. */
 bool dir_add(struct dir *dir, const char *name, block_sector_t inode_sector) {
     struct dir_entry e;
-    off_t ofs;
     bool success = false;
 
     ASSERT(dir != NULL);
@@ -160,24 +426,18 @@ bool dir_add(struct dir *dir, const char *name, block_sector_t inode_sector) {
         goto done;
     }
 
-    /* Set OFS to offset of free slot.
-       If there are no free slots, then it will be set to the
-       current end-of-file.
-     
-       inode_read_at() will only return a short read at end of file.
-       Otherwise, we'd need to verify that we didn't get a short
-       read due to something intermittent such as low memory. */
-    for (ofs = 0; inode_read_at(dir->inode, &e, sizeof(e), ofs) == sizeof(e);
-         ofs += sizeof(e)) {
-        if (!e.in_use)
-            break;
-    }
-
-    /* Write slot. */
+    /* Put the entry in or near its home bucket, growing the directory
+       if they're all full. */
+    memset(&e, 0, sizeof e);
     e.in_use = true;
     strlcpy(e.name, name, sizeof e.name);
     e.inode_sector = inode_sector;
-    success = inode_write_at(dir->inode, &e, sizeof(e), ofs) == sizeof(e);
+    while (!(success = dir_insert(dir, &e))) {
+        if (!dir_grow(dir))
+            break;
+    }
+    if (success)
+        dcache_invalidate(inode_get_inumber(dir->inode), name);
 
 done:
     return success;
@@ -207,6 +467,7 @@ bool dir_remove(struct dir *dir, const char *name) {
     e.in_use = false;
     if (inode_write_at(dir->inode, &e, sizeof(e), ofs) != sizeof(e))
         goto done;
+    dcache_invalidate(inode_get_inumber(dir->inode), name);
 
     /* Remove inode. */
     inode_remove(inode);
@@ -227,6 +488,11 @@ bool dir_readdir(struct dir *dir, char name[NAME_MAX + 1]) {
     while (inode_read_at(dir->inode, &e, sizeof(e), dir->pos) == sizeof(e)) {
         dir->pos += sizeof(e);
 
+        /* Skip the rest of the bucket after its last entry. */
+        if (dir->pos % BLOCK_SECTOR_SIZE
+            == DIR_BUCKET_ENTRIES * sizeof(e))
+            dir->pos = ROUND_UP(dir->pos, BLOCK_SECTOR_SIZE);
+
         /* If file is in-use, it is not self, and it is not its parent, then 
         it can be printed. */
         if (e.in_use && !(strcmp(parent_link, e.name) == 0) &&
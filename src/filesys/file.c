@@ -8,6 +8,7 @@ struct file {
     struct inode *inode;        /*!< File's inode. */
     off_t pos;                  /*!< Current position. */
     bool deny_write;            /*!< Has file_deny_write() been called? */
+    struct read_ahead ra;       /*!< Sequential read detection. */
 };
 
 /*! Opens a file for the given INODE, of which it takes ownership,
@@ -19,6 +20,7 @@ struct file * file_open(struct inode *inode) {
         file->inode = inode;
         file->pos = 0;
         file->deny_write = false;
+        inode_read_ahead_init(&file->ra);
         return file;
     }
     else {
@@ -53,7 +55,8 @@ struct inode * file_get_inode(struct file *file) {
     than SIZE if end of file is reached.  Advances FILE's position by the
     number of bytes read. */
 off_t file_read(struct file *file, void *buffer, off_t size) {
-    off_t bytes_read = inode_read_at(file->inode, buffer, size, file->pos);
+    off_t bytes_read = inode_read_stream(file->inode, buffer, size, file->pos,
+                                         &file->ra);
     file->pos += bytes_read;
     return bytes_read;
 }
@@ -64,7 +67,7 @@ off_t file_read(struct file *file, void *buffer, off_t size) {
     unaffected. */
 off_t file_read_at(struct file *file, void *buffer, off_t size,
                    off_t file_ofs) {
-    return inode_read_at(file->inode, buffer, size, file_ofs);
+    return inode_read_stream(file->inode, buffer, size, file_ofs, &file->ra);
 }
 
 /*! Writes SIZE bytes from BUFFER into FILE, starting at the file's current
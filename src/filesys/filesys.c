@@ -7,6 +7,7 @@
 #include "filesys/file.h"
 #include "filesys/free-map.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
 #include "devices/block.h"
 #include "threads/thread.h"
 #include "threads/malloc.h"
@@ -15,6 +16,9 @@
 struct block *fs_device;
 
 static void do_format(void);
+static bool do_create(const char *path, off_t initial_size,
+                      bool is_directory);
+static bool do_remove(const char *path);
 static bool split_path_parent_name(const char *path, char ** parent_dir_name, 
                     char ** name, bool is_directory);
 
@@ -26,18 +30,30 @@ void filesys_init(bool format) {
         PANIC("No file system device found, can't initialize file system.");
 
     inode_init();
+    dir_init();
     free_map_init();
+    journal_init();
 
     if (format) 
         do_format();
+    else
+        journal_recover();
+
+    /* Refuse a disk whose inodes this kernel can't read. */
+    struct inode *root = inode_open(ROOT_DIR_SECTOR);
+    if (root == NULL)
+        PANIC("Root directory unreadable; the disk needs formatting.");
+    inode_close(root);
 
     free_map_open();
 }
 
 /*! Shuts down the file system module, writing any unwritten data to disk. */
 void filesys_done(void) {
-    flush_cache();
+    inode_reclaim();
     free_map_close();
+    journal_done();
+    flush_cache();
 }
 
 static bool split_path_parent_name(const char *path, char ** parent_dir_name, 
@@ -89,6 +105,17 @@ static bool split_path_parent_name(const char *path, char ** parent_dir_name,
     successful, false otherwise.  Fails if a file named NAME already exists,
     or if internal memory allocation fails. */
 bool filesys_create(const char *path, off_t initial_size, bool is_directory) {
+    /* Adding the entry may grow the directory. */
+    journal_begin_credits(JOURNAL_LARGE_CREDITS);
+    bool success = do_create(path, initial_size, is_directory);
+    journal_end();
+    return success;
+}
+
+/*! Does the work of filesys_create(), within a journal handle so that
+    the new inode and its directory entry are committed together. */
+static bool do_create(const char *path, off_t initial_size,
+                      bool is_directory) {
     block_sector_t inode_sector = 0;
 
     /* Get parent directory and name of file/directory to be created at  
@@ -194,6 +221,14 @@ struct file * filesys_open(const char *path) {
     Fails if no file named NAME exists, or if an internal memory allocation
     fails. */
 bool filesys_remove(const char *path) {
+    journal_begin();
+    bool success = do_remove(path);
+    journal_end();
+    return success;
+}
+
+/*! Does the work of filesys_remove(), within a journal handle. */
+static bool do_remove(const char *path) {
     /* Get parent directory and name of file/directory to be removed at  
     path. */
     char *parent_dir_name;
@@ -263,5 +298,7 @@ static void do_format(void) {
     dir_add(new_dir, relative_link, ROOT_DIR_SECTOR);
     relative_link[1] = '\0';
     dir_add(new_dir, relative_link, ROOT_DIR_SECTOR); 
+
+    journal_format();
 }
 
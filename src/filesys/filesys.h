@@ -7,6 +7,8 @@
 /*! Sectors of system file inodes. @{ */
 #define FREE_MAP_SECTOR 0       /*!< Free map file inode sector. */
 #define ROOT_DIR_SECTOR 1       /*!< Root directory file inode sector. */
+#define FREE_MAP_LOG_SECTOR 2   /*!< Free map intent log sector. */
+#define JOURNAL_SECTOR 3        /*!< First sector of metadata journal. */
 #define MAX_FILES_PER_DIR 150
 /*! @} */
 
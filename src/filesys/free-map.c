@@ -1,12 +1,89 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
 #include <string.h>
+#include "filesys/cache.h"
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
 
+/*! Sectors summarized by each entry in group_free. */
+#define FREE_MAP_GROUP 1024
+
+/*! Identifies the free map intent log. */
+#define FREE_MAP_LOG_MAGIC 0x464d4c47
+
+/*! Sectors whose bits each sector of the free map file holds. */
+#define FREE_MAP_SECTOR_BITS (BLOCK_SECTOR_SIZE * 8)
+
+/*! Free map sectors a transaction may write whole to make room in a full
+    log, on top of what its handles reserve. */
+#define FREE_MAP_FOLDS 2
+
+/*! Changes the log holds before they're checkpointed. */
+#define FREE_MAP_LOG_ENTRIES \
+    ((BLOCK_SECTOR_SIZE - 2 * sizeof (uint32_t)) \
+     / sizeof (struct free_map_log_entry))
+
+/*! A change made to the free map. */
+struct free_map_log_entry {
+    block_sector_t start;           /*!< First sector changed. */
+    uint32_t cnt;                   /*!< Number of sectors changed. */
+    uint32_t allocated;             /*!< Nonzero if now in use. */
+};
+
+/*! On-disk intent log, in FREE_MAP_LOG_SECTOR. The free map file holds
+    the map as of the last checkpoint; replaying the entries here, in
+    order, brings it up to date. No entry spans two sectors of the file,
+    so that each sector can be brought up to date, and its entries
+    dropped, on its own. Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct free_map_log {
+    unsigned magic;                 /*!< FREE_MAP_LOG_MAGIC. */
+    uint32_t entry_cnt;             /*!< Entries in use. */
+    struct free_map_log_entry entries[FREE_MAP_LOG_ENTRIES];
+};
+
+static struct lock free_map_lock;   /*!< Guards the free map and below. */
+static size_t free_cnt;             /*!< Free sectors on the disk. */
+static size_t pending_cnt;          /*!< Sectors to be freed by reclaim. */
+static size_t *group_free;          /*!< Free sectors in each group. */
+static size_t group_cnt;            /*!< Number of groups. */
+static size_t next_fit;             /*!< Where the next search starts. */
+static struct bitmap *reserved;     /*!< Sectors set aside for files. */
+static struct bitmap *released;     /*!< Freed since the last commit. */
+static size_t released_cnt;         /*!< Sectors in released. */
+static struct bitmap *recent;       /*!< Allocated since the last commit. */
+static struct free_map_log free_log;  /*!< Changes since checkpoint. */
+static struct cache_owner log_dirty;  /*!< The log sector, if dirty. */
+static struct bitmap *folded;       /*!< File sectors written whole by the
+                                         running transaction. */
+static struct bitmap *stale;        /*!< File sectors with changes that
+                                         couldn't be logged. */
+
+static void free_map_count(void);
+static bool sector_free(size_t sector);
+static void free_map_take(struct bitmap *map, block_sector_t sector,
+    size_t cnt);
+static size_t free_map_find(block_sector_t goal, size_t cnt,
+    block_sector_t *sectorp);
+static bool free_map_log_append(block_sector_t start, size_t cnt,
+    bool allocated);
+static size_t free_map_log_needed(block_sector_t start, size_t cnt,
+    bool allocated);
+static struct free_map_log_entry *free_map_log_tail(block_sector_t start,
+    bool allocated);
+static bool free_map_make_room(block_sector_t start, size_t cnt,
+    bool allocated);
+static void free_map_fold(size_t k);
+static void free_map_log_compact(void);
+static void free_map_log_write(void);
+static void free_map_mark_stale(block_sector_t start, size_t cnt);
+static void free_map_write_range(block_sector_t start, size_t cnt);
+static void free_map_give_back(block_sector_t sector, size_t cnt);
 
 /*! Initializes the free map. */
 void free_map_init(void) {
@@ -15,68 +92,636 @@ void free_map_init(void) {
         PANIC("bitmap creation failed--file system device is too large");
     bitmap_mark(free_map, FREE_MAP_SECTOR);
     bitmap_mark(free_map, ROOT_DIR_SECTOR);
+    bitmap_mark(free_map, FREE_MAP_LOG_SECTOR);
+    bitmap_set_multiple(free_map, JOURNAL_SECTOR, JOURNAL_SECTORS, true);
+
+    group_cnt = DIV_ROUND_UP(bitmap_size(free_map), FREE_MAP_GROUP);
+    group_free = malloc(group_cnt * sizeof *group_free);
+    if (group_free == NULL)
+        PANIC("can't allocate free map summary");
+    reserved = bitmap_create(bitmap_size(free_map));
+    released = bitmap_create(bitmap_size(free_map));
+    recent = bitmap_create(bitmap_size(free_map));
+    if (reserved == NULL || released == NULL || recent == NULL)
+        PANIC("can't allocate free map reservations");
+    size_t file_sectors = DIV_ROUND_UP(bitmap_size(free_map),
+                                       FREE_MAP_SECTOR_BITS);
+    folded = bitmap_create(file_sectors);
+    stale = bitmap_create(file_sectors);
+    if (folded == NULL || stale == NULL)
+        PANIC("can't allocate free map checkpoint state");
+    released_cnt = 0;
+    lock_init(&free_map_lock);
+    cache_owner_init(&log_dirty);
+    next_fit = 0;
+    pending_cnt = 0;
+    free_map_count();
+}
+
+/* Recomputes the free counts from the bitmap. */
+static void free_map_count(void) {
+    size_t sectors = bitmap_size(free_map);
+
+    free_cnt = 0;
+    for (size_t g = 0; g < group_cnt; g++) {
+        size_t start = g * FREE_MAP_GROUP;
+        size_t cnt = sectors - start < FREE_MAP_GROUP ? sectors - start
+                                                      : FREE_MAP_GROUP;
+        group_free[g] = bitmap_count(free_map, start, cnt, false);
+        free_cnt += group_free[g];
+    }
+}
+
+/* Adds DELTA free sectors to the counts of the groups CNT sectors from
+   SECTOR lie in. */
+static void free_map_adjust(block_sector_t sector, size_t cnt, int delta) {
+    while (cnt > 0) {
+        size_t g = sector / FREE_MAP_GROUP;
+        size_t in_group = FREE_MAP_GROUP - sector % FREE_MAP_GROUP;
+        if (in_group > cnt) {
+            in_group = cnt;
+        }
+        group_free[g] += delta * (int) in_group;
+        free_cnt += delta * (int) in_group;
+        sector += in_group;
+        cnt -= in_group;
+    }
+}
+
+/* Returns true if SECTOR is neither in use, reserved, nor freed since
+   the last commit. */
+static bool sector_free(size_t sector) {
+    return !bitmap_test(free_map, sector) && !bitmap_test(reserved, sector)
+           && !bitmap_test(released, sector);
+}
+
+/* Marks the CNT free sectors from SECTOR in MAP: in the free map as in
+   use, or in the reservations as reserved. */
+static void free_map_take(struct bitmap *map, block_sector_t sector,
+                          size_t cnt) {
+    ASSERT(lock_held_by_current_thread(&free_map_lock));
+    ASSERT(bitmap_none(free_map, sector, cnt));
+    ASSERT(bitmap_none(reserved, sector, cnt));
+    ASSERT(bitmap_none(released, sector, cnt));
+
+    bitmap_set_multiple(map, sector, cnt, true);
+    if (map == free_map) {
+        bitmap_set_multiple(recent, sector, cnt, true);
+    }
+    free_map_adjust(sector, cnt, -1);
+    next_fit = sector + cnt;
+    if (next_fit >= bitmap_size(free_map)) {
+        next_fit = 0;
+    }
+}
+
+/* Finds up to CNT consecutive free sectors, stores the first into
+   *SECTORP and returns how many there are, or 0 if the disk is full.
+   Reserved sectors aren't free.
+   The run starts at GOAL if that is free; otherwise it is the first free
+   one from where the last search left off, skipping full groups. */
+static size_t free_map_find(block_sector_t goal, size_t cnt,
+                            block_sector_t *sectorp) {
+    size_t sectors = bitmap_size(free_map);
+    size_t start = BITMAP_ERROR;
+
+    ASSERT(lock_held_by_current_thread(&free_map_lock));
+
+    if (free_cnt == 0 || cnt == 0) {
+        return 0;
+    }
+
+    if (goal < sectors && sector_free(goal)) {
+        start = goal;
+    } else {
+        /* Visit every group once, beginning with the next-fit one. */
+        size_t first = next_fit / FREE_MAP_GROUP;
+        for (size_t i = 0; i <= group_cnt && start == BITMAP_ERROR; i++) {
+            size_t g = (first + i) % group_cnt;
+            if (group_free[g] == 0) {
+                continue;
+            }
+
+            size_t lo = g * FREE_MAP_GROUP;
+            size_t hi = lo + FREE_MAP_GROUP < sectors ? lo + FREE_MAP_GROUP
+                                                      : sectors;
+            if (i == 0 && next_fit > lo) {
+                lo = next_fit;
+            }
+            for (size_t s = lo; s < hi; s++) {
+                if (sector_free(s)) {
+                    start = s;
+                    break;
+                }
+            }
+        }
+        ASSERT(start != BITMAP_ERROR);
+    }
+
+    size_t run = 1;
+    while (run < cnt && start + run < sectors && sector_free(start + run)) {
+        run++;
+    }
+    *sectorp = start;
+    return run;
+}
+
+/* Records in the log that the CNT sectors from START are now ALLOCATED
+   or free, a separate entry for each sector of the free map file they
+   lie in, unless it follows on from the last. Changes to file sectors the
+   running transaction writes whole go straight into the file instead.
+   If the log is full, sectors are written whole to make room; if that
+   isn't enough, nothing is recorded and this returns false. The log
+   sector is written back with the rest of the cache, or by
+   free_map_flush(); the free map file only at the next checkpoint.
+   Changes made while formatting, before the journal is in use, go
+   straight into the file, if it exists yet. */
+static bool free_map_log_append(block_sector_t start, size_t cnt,
+                                bool allocated) {
+    ASSERT(lock_held_by_current_thread(&free_map_lock));
+
+    if (free_map_file == NULL) {
+        return true;
+    }
+    if (!journal_enabled()) {
+        free_map_write_range(start, cnt);
+        return true;
+    }
+    if (!free_map_make_room(start, cnt, allocated)) {
+        return false;
+    }
+
+    bool logged = false;
+    while (cnt > 0) {
+        size_t k = start / FREE_MAP_SECTOR_BITS;
+        size_t n = (k + 1) * FREE_MAP_SECTOR_BITS - start;
+        if (n > cnt) {
+            n = cnt;
+        }
+
+        struct free_map_log_entry *tail = free_map_log_tail(start,
+            allocated);
+        if (bitmap_test(folded, k)) {
+            free_map_write_range(start, n);
+        } else if (tail != NULL) {
+            tail->cnt += n;
+            logged = true;
+        } else {
+            struct free_map_log_entry *e =
+                &free_log.entries[free_log.entry_cnt++];
+            e->start = start;
+            e->cnt = n;
+            e->allocated = allocated;
+            logged = true;
+        }
+        start += n;
+        cnt -= n;
+    }
+    if (logged) {
+        free_map_log_write();
+    }
+    return true;
+}
+
+/* Returns the number of entries free_map_log_append() would add to the
+   log for the same change. */
+static size_t free_map_log_needed(block_sector_t start, size_t cnt,
+                                  bool allocated) {
+    size_t needed = 0;
+    bool first = true;
+
+    while (cnt > 0) {
+        size_t k = start / FREE_MAP_SECTOR_BITS;
+        size_t n = (k + 1) * FREE_MAP_SECTOR_BITS - start;
+        if (n > cnt) {
+            n = cnt;
+        }
+
+        bool merges = first && free_map_log_tail(start, allocated) != NULL;
+        if (!bitmap_test(folded, k) && !merges) {
+            needed++;
+        }
+        first = false;
+        start += n;
+        cnt -= n;
+    }
+    return needed;
+}
+
+/* Returns the last entry of the log if a change from START, which is
+   now ALLOCATED or free, follows on from it in the same sector of the
+   free map file, so that the entry can take it in; otherwise, returns a
+   null pointer. */
+static struct free_map_log_entry *free_map_log_tail(block_sector_t start,
+                                                    bool allocated) {
+    if (free_log.entry_cnt == 0) {
+        return NULL;
+    }
+
+    struct free_map_log_entry *e = &free_log.entries[free_log.entry_cnt - 1];
+    if (e->start + e->cnt != start
+        || e->start / FREE_MAP_SECTOR_BITS != start / FREE_MAP_SECTOR_BITS
+        || (e->allocated != 0) != allocated) {
+        return NULL;
+    }
+    return e;
+}
+
+/* Writes sectors of the free map file whole until the log has room for
+   the change to the CNT sectors from START, now ALLOCATED or free, as
+   free_map_log_append() records it, each charged to the sectors the
+   journal sets aside for the running transaction. The file sector that
+   drops the most entries is written first, or, if none would, one the
+   change lies in. Returns false if the sectors set aside run out
+   first. */
+static bool free_map_make_room(block_sector_t start, size_t cnt,
+                               bool allocated) {
+    while (FREE_MAP_LOG_ENTRIES - free_log.entry_cnt
+           < free_map_log_needed(start, cnt, allocated)) {
+        size_t best = BITMAP_ERROR;
+        size_t best_cnt = 0;
+        for (size_t i = 0; i < free_log.entry_cnt; i++) {
+            size_t k = free_log.entries[i].start / FREE_MAP_SECTOR_BITS;
+            size_t n = 0;
+            for (size_t j = i; j < free_log.entry_cnt; j++) {
+                if (free_log.entries[j].start / FREE_MAP_SECTOR_BITS == k) {
+                    n++;
+                }
+            }
+            if (n > best_cnt && !bitmap_test(folded, k)) {
+                best = k;
+                best_cnt = n;
+            }
+        }
+        if (best == BITMAP_ERROR) {
+            best = bitmap_scan(folded, start / FREE_MAP_SECTOR_BITS, 1,
+                               false);
+            if (best > (start + cnt - 1) / FREE_MAP_SECTOR_BITS) {
+                best = BITMAP_ERROR;
+            }
+        }
+        if (best == BITMAP_ERROR || !journal_take_set_aside()) {
+            return false;
+        }
+        free_map_fold(best);
+        free_map_log_compact();
+    }
+    return true;
+}
+
+/* Writes sector K of the free map file whole, from the free map in
+   memory, and notes that the running transaction does. */
+static void free_map_fold(size_t k) {
+    ASSERT(lock_held_by_current_thread(&free_map_lock));
+
+    size_t start = k * FREE_MAP_SECTOR_BITS;
+    size_t cnt = bitmap_size(free_map) - start;
+    if (cnt > FREE_MAP_SECTOR_BITS) {
+        cnt = FREE_MAP_SECTOR_BITS;
+    }
+    free_map_write_range(start, cnt);
+    bitmap_mark(folded, k);
+    bitmap_reset(stale, k);
+}
+
+/* Drops the entries of the log whose file sectors have been written
+   whole, and writes the log. Without the journal, nothing else is to be
+   written along with the sectors, so none are left noted as written. */
+static void free_map_log_compact(void) {
+    size_t kept = 0;
+
+    for (size_t i = 0; i < free_log.entry_cnt; i++) {
+        struct free_map_log_entry *e = &free_log.entries[i];
+        size_t first = e->start / FREE_MAP_SECTOR_BITS;
+        size_t last = (e->start + e->cnt - 1) / FREE_MAP_SECTOR_BITS;
+        if (!bitmap_all(folded, first, last - first + 1)) {
+            free_log.entries[kept++] = *e;
+        }
+    }
+    free_log.entry_cnt = kept;
+    free_map_log_write();
+
+    if (!journal_enabled()) {
+        bitmap_set_all(folded, false);
+    }
+}
+
+/* Writes the log to its sector in the cache. */
+static void free_map_log_write(void) {
+    cache_write(FREE_MAP_LOG_SECTOR, &free_log, BLOCK_SECTOR_SIZE, 0,
+        CACHE_META, &log_dirty);
+}
+
+/* Notes that the file sectors the CNT sectors from START lie in may not
+   hold what the log leads to, so that the next checkpoint writes them
+   whole. */
+static void free_map_mark_stale(block_sector_t start, size_t cnt) {
+    size_t first = start / FREE_MAP_SECTOR_BITS;
+    size_t last = (start + cnt - 1) / FREE_MAP_SECTOR_BITS;
+    bitmap_set_multiple(stale, first, last - first + 1, true);
+}
+
+/* Writes the bytes of the free map file that hold the bits of the CNT
+   sectors from START, and no others. */
+static void free_map_write_range(block_sector_t start, size_t cnt) {
+    size_t first = start / 8;
+    size_t last = (start + cnt - 1) / 8;
+    uint8_t buf[64];
+
+    while (first <= last) {
+        size_t n = last - first + 1 < sizeof buf ? last - first + 1
+                                                 : sizeof buf;
+        for (size_t i = 0; i < n; i++) {
+            uint8_t byte = 0;
+            for (size_t bit = 0; bit < 8; bit++) {
+                size_t idx = (first + i) * 8 + bit;
+                if (idx < bitmap_size(free_map) && bitmap_test(free_map, idx))
+                    byte |= 1 << bit;
+            }
+            buf[i] = byte;
+        }
+        file_write_at(free_map_file, buf, n, first);
+        first += n;
+    }
+}
+
+/*! Returns true if the free map file is due a checkpoint: the log is
+    more than half full, or holds changes that couldn't be logged. */
+bool free_map_checkpoint_due(void) {
+    lock_acquire(&free_map_lock);
+    bool due = free_map_file != NULL
+               && (free_log.entry_cnt > FREE_MAP_LOG_ENTRIES / 2
+                   || !bitmap_none(stale, 0, bitmap_size(stale)));
+    lock_release(&free_map_lock);
+    return due;
 }
 
-/*! Allocates CNT consecutive sectors from the free map and stores the first
-    into *SECTORP.
-    Returns true if successful, false if not enough consecutive sectors were
-    available or if the free_map file could not be written. */
-bool free_map_allocate(size_t cnt, block_sector_t *sectorp) {
-    block_sector_t sector = bitmap_scan_and_flip(free_map, 0, cnt, false);
-    if (sector != BITMAP_ERROR && free_map_file != NULL &&
-        !bitmap_write(free_map, free_map_file)) {
-        bitmap_set_multiple(free_map, sector, cnt, false); 
-        sector = BITMAP_ERROR;
+/*! Brings up to MAX sectors of the free map file up to date, and drops
+    their entries from the log: those with changes that couldn't be
+    logged first, then those the oldest entries lie in. Writes the log
+    too, so that a journal handle for MAX + 1 sectors holds it all; the
+    journal runs it in a transaction of its own after a commit. Without
+    the journal, it is all written back. */
+void free_map_checkpoint(size_t max) {
+    lock_acquire(&free_map_lock);
+
+    size_t written = 0;
+    size_t k = 0;
+    while (written < max
+           && (k = bitmap_scan(stale, k, 1, true)) != BITMAP_ERROR) {
+        free_map_fold(k);
+        written++;
     }
-    if (sector != BITMAP_ERROR)
+    for (size_t i = 0; i < free_log.entry_cnt; i++) {
+        struct free_map_log_entry *e = &free_log.entries[i];
+        size_t first = e->start / FREE_MAP_SECTOR_BITS;
+        size_t last = (e->start + e->cnt - 1) / FREE_MAP_SECTOR_BITS;
+        size_t cnt = bitmap_count(folded, first, last - first + 1, false);
+        if (written + cnt > max) {
+            break;
+        }
+        for (k = first; k <= last; k++) {
+            if (!bitmap_test(folded, k)) {
+                free_map_fold(k);
+            }
+        }
+        written += cnt;
+    }
+    free_map_log_compact();
+
+    inode_flush(file_get_inode(free_map_file), true);
+    cache_owner_flush(&log_dirty);
+    lock_release(&free_map_lock);
+}
+
+/*! Allocates up to CNT consecutive sectors, starting at GOAL if it is
+    free, so that a file can be laid out contiguously: callers pass the
+    sector following the file's last. Stores the first into *SECTORP and
+    returns how many were allocated, which is 0 if the disk is full, or
+    if the allocation can't be logged until the journal commits. */
+size_t free_map_allocate_run(block_sector_t goal, size_t cnt,
+                             block_sector_t *sectorp) {
+    lock_acquire(&free_map_lock);
+    block_sector_t sector;
+    size_t run = free_map_find(goal, cnt, &sector);
+    if (run > 0) {
+        free_map_take(free_map, sector, run);
+        if (!free_map_log_append(sector, run, true)) {
+            /* Sectors of the file written whole to make room hold them as
+               allocated. */
+            bitmap_set_multiple(free_map, sector, run, false);
+            bitmap_set_multiple(recent, sector, run, false);
+            free_map_adjust(sector, run, 1);
+            free_map_mark_stale(sector, run);
+            run = 0;
+        }
+    }
+    lock_release(&free_map_lock);
+
+    if (run > 0)
         *sectorp = sector;
-    return sector != BITMAP_ERROR;
+    return run;
 }
 
 /* Allocate a single sector from the free map and stores it into *SECTORP. 
-   Returns true if successful, false if not enough consecutive sectors were
-   available or if the free_map file could not be written. */
+   Returns true if successful, false if no sector was available. */
 bool free_map_allocate_single(block_sector_t *sectorp) {
-    block_sector_t sector = bitmap_scan_and_flip(free_map, 0, 1, false);
-    if (sector != BITMAP_ERROR && free_map_file != NULL &&
-        !bitmap_write(free_map, free_map_file)) {
-        bitmap_reset(free_map, sector);
-        sector = BITMAP_ERROR;
-    }
-    if (sector != BITMAP_ERROR)
+    return free_map_allocate_run(BITMAP_ERROR, 1, sectorp) == 1;
+}
+
+/*! Reserves up to CNT consecutive sectors as free_map_allocate_run()
+    allocate them, without recording them in the free map: they are not
+    handed out to anyone else, but are free again after a crash. Stores
+    the first into *SECTORP and returns how many were reserved. */
+size_t free_map_reserve(block_sector_t goal, size_t cnt,
+                        block_sector_t *sectorp) {
+    lock_acquire(&free_map_lock);
+    block_sector_t sector;
+    size_t run = free_map_find(goal, cnt, &sector);
+    if (run > 0)
+        free_map_take(reserved, sector, run);
+    lock_release(&free_map_lock);
+
+    if (run > 0)
         *sectorp = sector;
-    return sector != BITMAP_ERROR;
+    return run;
+}
+
+/*! Allocates the CNT reserved sectors from SECTOR. Returns false, and
+    leaves them reserved, if the allocation can't be logged until the
+    journal commits. */
+bool free_map_claim(block_sector_t sector, size_t cnt) {
+    lock_acquire(&free_map_lock);
+    ASSERT(bitmap_all(reserved, sector, cnt));
+    bitmap_set_multiple(reserved, sector, cnt, false);
+    bitmap_set_multiple(free_map, sector, cnt, true);
+    bitmap_set_multiple(recent, sector, cnt, true);
+    bool success = free_map_log_append(sector, cnt, true);
+    if (!success) {
+        bitmap_set_multiple(free_map, sector, cnt, false);
+        bitmap_set_multiple(recent, sector, cnt, false);
+        bitmap_set_multiple(reserved, sector, cnt, true);
+        free_map_mark_stale(sector, cnt);
+    }
+    lock_release(&free_map_lock);
+    return success;
+}
+
+/*! Gives up the reservation of the CNT sectors from SECTOR. */
+void free_map_unreserve(block_sector_t sector, size_t cnt) {
+    lock_acquire(&free_map_lock);
+    ASSERT(bitmap_all(reserved, sector, cnt));
+    bitmap_set_multiple(reserved, sector, cnt, false);
+    free_map_adjust(sector, cnt, 1);
+    lock_release(&free_map_lock);
+}
+
+/*! Returns the number of free sectors, not counting reserved ones, nor
+    those freed since the journal last committed. */
+size_t free_map_free_count(void) {
+    return free_cnt;
 }
 
 /* Makes sector available for use. */
 void free_map_release_single(block_sector_t sector) {
-    ASSERT(bitmap_test(free_map, sector));
-    bitmap_reset(free_map, sector);
-    bitmap_write(free_map, free_map_file);
+    free_map_release(sector, 1);
 }
 
-/*! Makes CNT sectors starting at SECTOR available for use. */
-void free_map_release(block_sector_t sector, size_t cnt) {
+/* Frees the CNT sectors from SECTOR in the free map. While the journal
+   is in use, they aren't handed out again until it commits: until then,
+   metadata on disk may still lead to them, and sectors newly allocated
+   may be written back before the commit. A change that can't be logged
+   is left to the next checkpoint; should the system crash first, the
+   sectors stay in use. */
+static void free_map_give_back(block_sector_t sector, size_t cnt) {
+    ASSERT(lock_held_by_current_thread(&free_map_lock));
     ASSERT(bitmap_all(free_map, sector, cnt));
+
     bitmap_set_multiple(free_map, sector, cnt, false);
-    bitmap_write(free_map, free_map_file);
+    if (journal_enabled() && free_map_file != NULL) {
+        bitmap_set_multiple(released, sector, cnt, true);
+        released_cnt += cnt;
+    } else {
+        free_map_adjust(sector, cnt, 1);
+    }
+    if (!free_map_log_append(sector, cnt, false)) {
+        free_map_mark_stale(sector, cnt);
+    }
+}
+
+/*! Makes CNT sectors starting at SECTOR available for use. */
+void free_map_release(block_sector_t sector, size_t cnt) {
+    lock_acquire(&free_map_lock);
+    free_map_give_back(sector, cnt);
+    lock_release(&free_map_lock);
+}
+
+/*! Counts CNT sectors, which a removed file still holds, as pending
+    free until free_map_release_deferred() releases them. */
+void free_map_defer(size_t cnt) {
+    lock_acquire(&free_map_lock);
+    pending_cnt += cnt;
+    lock_release(&free_map_lock);
+}
+
+/*! Makes CNT sectors starting at SECTOR, which were counted as pending
+    free, available for use. */
+void free_map_release_deferred(block_sector_t sector, size_t cnt) {
+    lock_acquire(&free_map_lock);
+    ASSERT(pending_cnt >= cnt);
+    free_map_give_back(sector, cnt);
+    pending_cnt -= cnt;
+    lock_release(&free_map_lock);
 }
 
-/*! Opens the free map file and reads it from disk. */
+/*! Returns the number of sectors that removed files hold until they're
+    reclaimed, which free_map_free_count() doesn't count yet. */
+size_t free_map_pending_count(void) {
+    return pending_cnt;
+}
+
+/*! Writes back the free map changes made so far, by way of the log,
+    which the journal commits along with the rest of the metadata if it
+    is in use. */
+void free_map_flush(void) {
+    if (journal_commit())
+        return;
+
+    lock_acquire(&free_map_lock);
+    cache_owner_flush(&log_dirty);
+    lock_release(&free_map_lock);
+}
+
+/*! Returns true if SECTOR has been allocated since the journal last
+    committed, so that the running transaction may lead to it. */
+bool free_map_is_new(block_sector_t sector) {
+    lock_acquire(&free_map_lock);
+    bool is_new = bitmap_test(recent, sector);
+    lock_release(&free_map_lock);
+    return is_new;
+}
+
+/*! Makes the sectors freed since the journal last committed available
+    for use. Called by the journal once it has committed. */
+void free_map_commit(void) {
+    lock_acquire(&free_map_lock);
+    bitmap_set_all(folded, false);
+    bitmap_set_all(recent, false);
+    for (size_t s = 0; released_cnt > 0; s++) {
+        s = bitmap_scan(released, s, 1, true);
+        ASSERT(s != BITMAP_ERROR);
+        bitmap_reset(released, s);
+        free_map_adjust(s, 1, 1);
+        released_cnt--;
+    }
+    lock_release(&free_map_lock);
+}
+
+/*! Opens the free map file and reads it from disk, then replays the
+    changes the log holds since it was last written. */
 void free_map_open(void) {
     free_map_file = file_open(inode_open(FREE_MAP_SECTOR));
     if (free_map_file == NULL)
         PANIC("can't open free map");
+    inode_set_metadata(file_get_inode(free_map_file));
     if (!bitmap_read(free_map, free_map_file))
         PANIC("can't read free map");
+
+    cache_read(FREE_MAP_LOG_SECTOR, &free_log, BLOCK_SECTOR_SIZE, 0,
+        CACHE_META);
+    if (free_log.magic != FREE_MAP_LOG_MAGIC
+        || free_log.entry_cnt > FREE_MAP_LOG_ENTRIES)
+        PANIC("free map log is corrupt");
+    for (size_t i = 0; i < free_log.entry_cnt; i++) {
+        struct free_map_log_entry *e = &free_log.entries[i];
+        bitmap_set_multiple(free_map, e->start, e->cnt, e->allocated != 0);
+    }
+    free_map_count();
+
+    /* Checkpoints run after commits, in transactions of their own, but
+       any handle may find the log full. */
+    journal_set_aside(FREE_MAP_FOLDS);
 }
 
 /*! Writes the free map to disk and closes the free map file. */
 void free_map_close(void) {
+    bool done;
+    do {
+        journal_begin_credits(JOURNAL_LARGE_CREDITS);
+        free_map_checkpoint(JOURNAL_LARGE_CREDITS - 1);
+        journal_end();
+
+        lock_acquire(&free_map_lock);
+        done = free_log.entry_cnt == 0
+               && bitmap_none(stale, 0, bitmap_size(stale));
+        lock_release(&free_map_lock);
+    } while (!done);
     file_close(free_map_file);
+    free_map_file = NULL;
 }
 
-/*! Creates a new free map file on disk and writes the free map to it. */
+/*! Creates a new free map file on disk and writes the free map to it,
+    along with an empty log. */
 void free_map_create(void) {
     /* Create inode. */
     if (!inode_create(FREE_MAP_SECTOR, bitmap_file_size(free_map), false))
@@ -86,6 +731,12 @@ void free_map_create(void) {
     free_map_file = file_open(inode_open(FREE_MAP_SECTOR));
     if (free_map_file == NULL)
         PANIC("can't open free map");
+    inode_set_metadata(file_get_inode(free_map_file));
     if (!bitmap_write(free_map, free_map_file))
         PANIC("can't write free map");
+
+    free_log.magic = FREE_MAP_LOG_MAGIC;
+    free_log.entry_cnt = 0;
+    cache_write(FREE_MAP_LOG_SECTOR, &free_log, BLOCK_SECTOR_SIZE, 0,
+        CACHE_META, &log_dirty);
 }
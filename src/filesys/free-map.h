@@ -14,8 +14,22 @@ void free_map_create(void);
 void free_map_open(void);
 void free_map_close(void);
 
-bool free_map_allocate(size_t, block_sector_t *);
+size_t free_map_allocate_run(block_sector_t goal, size_t cnt,
+                             block_sector_t *sectorp);
 void free_map_release(block_sector_t, size_t);
+size_t free_map_reserve(block_sector_t goal, size_t cnt,
+                        block_sector_t *sectorp);
+bool free_map_claim(block_sector_t sector, size_t cnt);
+void free_map_unreserve(block_sector_t sector, size_t cnt);
+size_t free_map_free_count(void);
+void free_map_defer(size_t cnt);
+void free_map_release_deferred(block_sector_t, size_t);
+size_t free_map_pending_count(void);
+void free_map_flush(void);
+void free_map_commit(void);
+bool free_map_is_new(block_sector_t sector);
+bool free_map_checkpoint_due(void);
+void free_map_checkpoint(size_t max);
 
 bool free_map_allocate_single(block_sector_t *sectorp);
 void free_map_release_single(block_sector_t sector);
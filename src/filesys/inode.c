@@ -1,32 +1,108 @@
 #include "filesys/inode.h"
-#include <list.h>
+#include <hash.h>
 #include <debug.h>
 #include <round.h>
+#include <stddef.h>
 #include <string.h>
-#include <bitmap.h>
 #include "filesys/filesys.h"
 #include "filesys/cache.h"
 #include "filesys/free-map.h"
+#include "filesys/journal.h"
+#include "filesys/range-lock.h"
+#include "threads/interrupt.h"
 #include "threads/malloc.h"
 #include "threads/synch.h"
+#include "threads/thread.h"
 
 #include <stdio.h>
 
 /*! Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
 
-/*! On-disk inode.
+/*! Version of the on-disk inode layout below. */
+#define INODE_FORMAT 2
+
+/*! A run of LENGTH consecutive sectors starting at START. */
+struct extent {
+    block_sector_t start;            /*!< First sector of the run. */
+    uint32_t length;                 /*!< Number of sectors in the run. */
+};
+
+/*! Bytes of data a small file keeps in its inode. */
+#define INODE_INLINE_MAX 480
+
+/*! Extents kept in the inode itself. */
+#define INODE_EXTENTS (INODE_INLINE_MAX / sizeof (struct extent))
+
+/*! Extents in each overflow extent block. */
+#define EXTENT_BLOCK_EXTENTS \
+    ((BLOCK_SECTOR_SIZE - 2 * sizeof (uint32_t)) / sizeof (struct extent))
+
+/*! Overflow extent block, for files with more than INODE_EXTENTS extents.
     Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct extent_block {
+    block_sector_t next;             /*!< Next extent block, or 0. */
+    uint32_t extent_cnt;             /*!< Extents in use. */
+    struct extent extents[EXTENT_BLOCK_EXTENTS];
+};
+
+/*! On-disk inode.
+    Must be exactly BLOCK_SECTOR_SIZE bytes long.
+
+    A file no longer than INODE_INLINE_MAX bytes that has never been
+    longer keeps its data inline.  Otherwise its data is a list of
+    extents, in file order: the first EXTENT_CNT here, and any more in a
+    chain of extent blocks from EXTENT_BLOCK to EXTENT_TAIL.  An extent
+    that starts at sector 0, which holds no file's data, is a hole: it
+    reads as zeros, and has no sectors until it is written. */
 struct inode_disk {
     volatile off_t length;           /*!< File size in bytes. */
     bool is_directory;               /*!< If inode represents a directory. */
+    volatile bool is_inline;         /*!< If data is kept in the inode. */
 
-    block_sector_t double_indirect;  /*!< Multilevel indirection. */
+    block_sector_t extent_block;     /*!< First extent block, or 0. */
+    block_sector_t extent_tail;      /*!< Last extent block, or 0. */
 
     unsigned magic;                  /*!< Magic number. */
-    uint32_t unused[124];            /*!< Not used. */
+    uint32_t format;                 /*!< INODE_FORMAT. */
+    uint32_t extent_cnt;             /*!< Extents in use in EXTENTS. */
+    union {
+        uint8_t inline_data[INODE_INLINE_MAX];  /*!< Data, if inline. */
+        struct extent extents[INODE_EXTENTS];   /*!< Otherwise, extents. */
+    };
+    uint32_t unused[1];              /*!< Not used. */
+};
+
+/*! Longest a file can be: the last whole sector an off_t can reach, so
+    that byte counts rounded up to sectors still fit in one. Extents
+    don't limit it; a file may be sparse, so it needn't fit on the disk
+    either. */
+#define INODE_MAX_LENGTH (INT32_MAX / BLOCK_SECTOR_SIZE * BLOCK_SECTOR_SIZE)
+
+/*! Sectors set aside at a time for an open file to grow into. */
+#define INODE_PREALLOC 32
+
+/*! Runs of sectors released together. */
+#define RELEASE_BATCH 32
+
+/*! Extents an open inode remembers the place of in its file. */
+#define INODE_MAP_SIZE 4
+
+/*! An extent of a file, with the file block its first sector holds.
+    Filling in a hole and replacing the file's contents are the only
+    changes to its extents other than growing them at the end, so the
+    map is emptied when those happen. */
+struct extent_map {
+    size_t first;                       /*!< Its first block in the file. */
+    struct extent extent;               /*!< Empty if unused. */
 };
 
+/*! Returns the kind of data held by the file DATA describes, for
+    the buffer cache. */
+static inline enum cache_class inode_disk_class(const struct inode_disk *data) {
+    return data->is_directory ? CACHE_META : CACHE_DATA;
+}
+
 /*! Returns the number of sectors to allocate for an inode SIZE
     bytes long. */
 static inline size_t bytes_to_sectors(off_t size) {
@@ -36,26 +112,73 @@ static inline size_t bytes_to_sectors(off_t size) {
 
 /*! In-memory inode. */
 struct inode {
-    struct list_elem elem;              /*!< Element in inode list. */
+    struct hash_elem elem;              /*!< Element in open_inodes. */
+    struct list_elem reclaim_elem;      /*!< Element in reclaim_queue. */
     block_sector_t sector;              /*!< Sector number of disk location. */
     int open_cnt;                       /*!< Number of openers. */
+    bool busy;                          /*!< Being read in or written out. */
+    struct condition settled;           /*!< Not busy any more. */
     bool removed;                       /*!< True if deleted, false otherwise.*/
     int deny_write_cnt;                 /*!< 0: writes ok, >0: deny writes. */
     struct lock extension_lock;         /*!< Lock to extend file. */
+    struct range_lock ranges;           /*!< Bytes being read or written. */
     struct inode_disk data;             /*!< Inode content. */
 
     int file_count;                     /*!< Count of files/subsdirectories. */
     struct lock dir_lock;               /*!< Lock to modify directory. */
+    volatile unsigned dir_seq;          /*!< Odd while being rehashed. */
+
+    bool metadata;                      /*!< File system's own bookkeeping. */
+    struct cache_owner dirty;           /*!< Sectors dirtied through it. */
+    bool changed;                       /*!< Changed since last commit. */
+    off_t synced_length;                /*!< Length as of last commit. */
+
+    struct extent_map map[INODE_MAP_SIZE];  /*!< Recently used extents. */
+    volatile unsigned map_seq;          /*!< Odd while extents change. */
+    unsigned map_next;                  /*!< Slot of map to reuse next. */
+    struct extent prealloc;             /*!< Reserved for it to grow into. */
 };
 
 
-static void indices_from_offset(off_t pos, size_t *dir_idx, size_t *ind_idx);
-static bool inode_extend_file(struct inode_disk *data, size_t cnt);
+static bool inode_extend_file(struct inode_disk *data, size_t cnt,
+    off_t write_ofs, enum cache_class class, struct cache_owner *owner,
+    struct extent *window);
+static size_t inode_allocate(struct inode_disk *data, size_t cnt,
+    bool zero, enum cache_class class, struct cache_owner *owner,
+    struct extent *window);
+static bool extent_append(struct inode_disk *data, block_sector_t start,
+    size_t length, struct cache_owner *owner);
+static block_sector_t extent_end(const struct inode_disk *data);
+static bool extent_follows(const struct extent *e, block_sector_t start);
+static void inode_release_blocks(struct inode_disk *data, bool pending);
+static size_t inode_count_blocks(const struct inode_disk *data);
+static void reclaim_thread(void *aux UNUSED);
+static bool inode_fill_holes(struct inode *inode, off_t offset, off_t size);
+static void extents_write(const struct extent *extents, size_t cnt,
+    const uint8_t **buffer, off_t *size, enum cache_class class,
+    struct cache_owner *owner);
+static void inode_store(struct inode *inode);
+static void inode_zero_blocks(struct inode *inode, size_t lo, size_t hi);
+static bool inode_inline_io(struct inode *inode, void *buffer, off_t size,
+    off_t offset, bool write);
+static enum cache_class inode_class(const struct inode *inode);
+static off_t inode_clip(off_t size, off_t offset);
 static void print_inode_allocation(struct inode_disk *data);
 
-/*! List of open inodes, so that opening a single inode twice
-    returns the same `struct inode'. */
-static struct list open_inodes;
+/*! Open inodes, keyed by sector, so that opening a single inode twice
+    returns the same `struct inode'. An inode is in it while it is read
+    in, and until it has been written out after its last close, but busy
+    then; the lock isn't held for the I/O, and those who find a busy
+    inode wait for it to settle and look again. */
+static struct hash open_inodes;
+static struct lock open_inodes_lock;    /*!< Guards it, busy, open counts. */
+
+/*! Removed inodes closed for the last time, whose sectors are still to be
+    freed, oldest first. The sectors are counted as pending free. */
+static struct list reclaim_queue;
+static struct lock reclaim_queue_lock;  /*!< Guards reclaim_queue. */
+static struct condition reclaim_queued; /*!< reclaim_queue isn't empty. */
+static struct lock reclaim_lock;        /*!< Held while freeing an inode. */
 
 
 void inode_check(struct inode *inode) {
@@ -75,214 +198,865 @@ block_sector_t inode_get_sector(struct inode *inode) {
     return inode->sector;
 }
 
-/* Given a certain position in a file, figure out the index in the single
-   indirect block and the direct block. Store these indexes in pointers. */
-static void indices_from_offset(off_t pos, size_t *dir_idx, size_t *ind_idx) {
-    *dir_idx = pos / BLOCK_SECTOR_SIZE;
-    *ind_idx = *dir_idx / NUM_ENTRIES_IN_INDIRECT;
-    *dir_idx %= NUM_ENTRIES_IN_INDIRECT;
-}
-
-/* Extends a file (as represented by an inode_disk *) by cnt bytes. */
-static bool inode_extend_file(struct inode_disk *data, size_t cnt) {
+/* Extends a file (as represented by an inode_disk *) holding CLASS of
+   data by cnt bytes, for a write that starts at byte WRITE_OFS and runs
+   to the new end of the file. Sectors the file doesn't have before the
+   one that byte is in are left as a hole. New sectors the write covers
+   whole aren't zeroed; the caller must hold the write's range locked
+   until it has written them. The sectors this dirties belong to OWNER,
+   if it is not null, and are taken from WINDOW, if not null, as
+   inode_allocate() does. A file that outgrows its inode has its inline
+   data moved out to its first sector. */
+static bool inode_extend_file(struct inode_disk *data, size_t cnt,
+                              off_t write_ofs, enum cache_class class,
+                              struct cache_owner *owner,
+                              struct extent *window) {
     ASSERT(data != NULL);
     ASSERT(data->magic == INODE_MAGIC);
 
-    /* Get the correct count of sectors we need. */
-
-    /* Calculate initial and final directed and indirected sector indices 
-    after appending cnt bytes. */
-    size_t dir_idx_f, ind_idx_f, dir_idx, ind_idx;
+    off_t length = data->length + cnt;
 
-    /* Subtract 1 because indices are 0-indexed (byte 1 is at index 0). */
-    indices_from_offset(data->length + cnt - 1, &dir_idx_f, &ind_idx_f);
-    /* Note that if data->length is 0, dir_idx is 0, which is correct. */
-    indices_from_offset(data->length - 1, &dir_idx, &ind_idx);
+    /* Still small enough to stay inline: the bytes past the old length
+       are zero already. */
+    if (data->is_inline && length <= INODE_INLINE_MAX) {
+        data->length = length;
+        return true;
+    }
 
-    size_t file_sectors = ((ind_idx_f - ind_idx) * NUM_ENTRIES_IN_INDIRECT + 
-        (dir_idx_f - dir_idx));
+    /* Outgrowing the inode: build extents in place of the inline data,
+       which is moved to the first sector. */
+    bool moving = data->is_inline;
+    uint8_t saved[INODE_INLINE_MAX];
+    if (moving) {
+        memcpy(saved, data->inline_data, INODE_INLINE_MAX);
+        memset(data->inline_data, 0, INODE_INLINE_MAX);
+        data->extent_cnt = 0;
+    }
 
-    /* Add number of sectors needed for the growth of the multi-level inode. */
-    size_t new_sectors = file_sectors + (ind_idx_f - ind_idx);
+    /* Sectors the file has; those it must have before any hole; those
+       the hole, if any, runs up to; and those it needs in all. Of the
+       last, those from WHOLE up to WHOLE_END are written whole. */
+    size_t have = moving ? 0 : bytes_to_sectors(data->length);
+    size_t keep = moving && data->length > 0 ? 1 : have;
+    size_t first = write_ofs / BLOCK_SECTOR_SIZE;
+    size_t need = bytes_to_sectors(length);
+    if (first < keep) {
+        first = keep;
+    }
+    if (first > need) {
+        first = need;
+    }
+    size_t whole = DIV_ROUND_UP(write_ofs, BLOCK_SECTOR_SIZE);
+    size_t whole_end = length / BLOCK_SECTOR_SIZE;
+    if (whole < first) {
+        whole = first;
+    }
+    if (whole_end < whole) {
+        whole_end = whole;
+    }
 
-    /* If there are not available free sectors for allocation, return false. */
-    size_t num_sectors = bitmap_size(free_map);
-    if (bitmap_count(free_map, 0, num_sectors, false) < new_sectors) {
-        return false;
+    /* Sectors allocated or left as a hole so far. */
+    size_t covered = have;
+    covered += inode_allocate(data, keep - have, true, class, owner,
+        window);
+    if (covered == keep && first > keep
+        && extent_append(data, 0, first - keep, owner)) {
+        covered = first;
+    }
+    if (covered == first) {
+        covered += inode_allocate(data, whole - first, true, class, owner,
+            window);
+    }
+    if (covered == whole) {
+        /* Metadata is zeroed all the same, which tells the cache it's
+           new, and keeps it out of the journal. */
+        covered += inode_allocate(data, whole_end - whole,
+            class != CACHE_DATA, class, owner, window);
+    }
+    if (covered == whole_end) {
+        covered += inode_allocate(data, need - whole_end, true, class,
+            owner, window);
     }
 
-    /* Set the new file length accordingly. */
-    data->length += cnt;
+    if (moving) {
+        if (covered < need) {
+            inode_release_blocks(data, false);
+            memcpy(data->inline_data, saved, INODE_INLINE_MAX);
+            return false;
+        }
+        if (data->length > 0) {
+            cache_write(data->extents[0].start, saved, data->length, 0,
+                class, owner);
+        }
 
-    /* If we don't need to allocate any new sectors, our job is finished. */
-    if (new_sectors == 0) {
+        /* Readers that see the flag cleared must see the extents. */
+        barrier();
+        data->is_inline = false;
+        data->length = length;
         return true;
     }
 
-    /* Else, we allocate the sectors and fill them into the inode_disk data. */
-    size_t num_found = 0;
-    
-    block_sector_t available_sectors[new_sectors];
+    if (covered < need) {
+        /* Keep what was allocated, so the file is as long as it can be
+           made. */
+        off_t room = (off_t) covered * BLOCK_SECTOR_SIZE;
+        if (room > data->length) {
+            data->length = room;
+        }
+        return false;
+    }
+    data->length = length;
+    return true;
+}
 
-    /* Find the sectors we need for allocation and save them in an array. */
-    size_t i;
-    for (i = 0; i < num_sectors; i++) {
-         /* We found a sector that is free, so give it to the inode. */
-        if (!bitmap_test(free_map, i)) {
-            bitmap_mark(free_map, i);
+/* Allocates CNT more sectors for the file DATA describes, holding CLASS
+   of data, zeroes them if ZERO and appends them to its extents, as few
+   as the free map allows. The sectors this dirties belong to OWNER, if it is
+   not null. Returns the number of sectors allocated, which is less than
+   CNT if the disk is too full; those that were stay in the extents.
+
+   If WINDOW is not null, it is a run of sectors reserved for the file
+   to grow into, at least INODE_PREALLOC long when it's set aside, so
+   that a file extended a little at a time stays contiguous even while
+   others grow too. */
+static size_t inode_allocate(struct inode_disk *data, size_t cnt,
+                             bool zero, enum cache_class class,
+                             struct cache_owner *owner,
+                             struct extent *window) {
+    size_t window_length = window != NULL ? window->length : 0;
+    if (window_length < cnt) {
+        inode_make_room(cnt - window_length);
+    }
+    if (free_map_free_count() + window_length < cnt) {
+        return 0;
+    }
 
-            available_sectors[num_found] = i;
-            num_found++;
-            if (num_found == new_sectors) {
-                break;
+    /* Carry on from where the file's data ends, if that's free. */
+    block_sector_t goal = extent_end(data);
+    size_t allocated = 0;
+    while (allocated < cnt) {
+        size_t want = cnt - allocated;
+        block_sector_t start;
+        size_t run;
+
+        if (window != NULL) {
+            /* A window that doesn't follow on from the file is no use,
+               unless the file ends in a hole. */
+            if (window->length > 0 && window->start != goal
+                && goal != (block_sector_t) -1) {
+                free_map_unreserve(window->start, window->length);
+                window->length = 0;
+            }
+            if (window->length == 0) {
+                window->length = free_map_reserve(goal,
+                    want > INODE_PREALLOC ? want : INODE_PREALLOC,
+                    &window->start);
+            }
+
+            run = want < window->length ? want : window->length;
+            start = window->start;
+            if (run > 0 && !free_map_claim(start, run)) {
+                run = 0;
             }
+            if (run > 0) {
+                window->start += run;
+                window->length -= run;
+            }
+        } else {
+            run = free_map_allocate_run(goal, want, &start);
+        }
+        if (run == 0) {
+            return allocated;
+        }
+
+        for (size_t i = 0; zero && i < run; i++) {
+            cache_zero(start + i, class, owner);
+        }
+        if (!extent_append(data, start, run, owner)) {
+            free_map_release(start, run);
+            return allocated;
         }
+        allocated += run;
+        goal = start + run;
     }
-    
-    /* If we were not able to allocate all blocks that we needed or we fail 
-    to persist our changes in free_map to its file, undo our changes and 
-    return false. */
-    if ((num_found != new_sectors) || 
-        (free_map_file != NULL && !bitmap_write(free_map, free_map_file))) {
+    return allocated;
+}
+
+/* Returns the sector following the last extent of DATA, or -1 if it has
+   none or the last is a hole. */
+static block_sector_t extent_end(const struct inode_disk *data) {
+    struct extent last = { 0, 0 };
+    if (data->extent_block != 0) {
+        const struct extent_block *tail = cache_get(data->extent_tail, false,
+            CACHE_INDEX, NULL);
+        last = tail->extents[tail->extent_cnt - 1];
+        cache_put(tail);
+    } else if (data->extent_cnt > 0) {
+        last = data->extents[data->extent_cnt - 1];
+    }
+    return last.start != 0 ? last.start + last.length : (block_sector_t) -1;
+}
+
+/* Returns true if the LENGTH sectors from START, a hole if START is 0,
+   carry straight on from extent E. */
+static bool extent_follows(const struct extent *e, block_sector_t start) {
+    if (e->start == 0 || start == 0) {
+        return e->start == start;
+    }
+    return e->start + e->length == start;
+}
 
-        for (i = 0; i < num_found; i++) {
-            bitmap_reset(free_map, available_sectors[i]);
+/* Appends the LENGTH sectors starting at START, or a hole LENGTH sectors
+   long if START is 0, to the extents of DATA, growing its last extent
+   instead if they follow on from it. The sectors
+   this dirties belong to OWNER, if it is not null. Returns false if a new
+   extent block was needed and could not be allocated. */
+static bool extent_append(struct inode_disk *data, block_sector_t start,
+                          size_t length, struct cache_owner *owner) {
+    if (data->extent_block == 0) {
+        if (data->extent_cnt > 0) {
+            struct extent *last = &data->extents[data->extent_cnt - 1];
+            if (extent_follows(last, start)) {
+                last->length += length;
+                return true;
+            }
+        }
+        if (data->extent_cnt < INODE_EXTENTS) {
+            data->extents[data->extent_cnt].start = start;
+            data->extents[data->extent_cnt].length = length;
+            data->extent_cnt++;
+            return true;
+        }
+    } else {
+        struct extent_block *tail = cache_get(data->extent_tail, true,
+            CACHE_INDEX, owner);
+        bool done = true;
+        struct extent *last = &tail->extents[tail->extent_cnt - 1];
+        if (extent_follows(last, start)) {
+            last->length += length;
+        } else if (tail->extent_cnt < EXTENT_BLOCK_EXTENTS) {
+            tail->extents[tail->extent_cnt].start = start;
+            tail->extents[tail->extent_cnt].length = length;
+            tail->extent_cnt++;
+        } else {
+            done = false;
+        }
+        cache_put(tail);
+        if (done) {
+            return true;
         }
-        return false;
     }
 
-    /* Allocate temporary buffers to hold the indexed sector data. */
-    block_sector_t *dir = malloc(BLOCK_SECTOR_SIZE);
-    if (dir == NULL) {
+    /* Out of room: chain on a new extent block. */
+    block_sector_t block;
+    if (!free_map_allocate_single(&block)) {
         return false;
     }
-    block_sector_t *ind = malloc(BLOCK_SECTOR_SIZE);
-    if (ind == NULL) {
-        free(dir);
-        return false;
+    cache_zero(block, CACHE_INDEX, owner);
+    struct extent_block *eb = cache_get(block, true, CACHE_INDEX, owner);
+    eb->extents[0].start = start;
+    eb->extents[0].length = length;
+    eb->extent_cnt = 1;
+    cache_put(eb);
+
+    if (data->extent_block == 0) {
+        data->extent_block = block;
+    } else {
+        struct extent_block *tail = cache_get(data->extent_tail, true,
+            CACHE_INDEX, owner);
+        tail->next = block;
+        cache_put(tail);
     }
+    data->extent_tail = block;
+    return true;
+}
 
-    /* Allocate temporary buffer to hold zeros for appended file data. */
-    void *zeros = calloc(1, BLOCK_SECTOR_SIZE);
-    if (zeros == NULL) {
-        free(dir);
-        free(ind);
-        return false;
+/* Sectors being given back to the free map, merged into runs where they
+   follow on from each other, so that each run is a single change to
+   it. */
+struct release_batch {
+    struct extent runs[RELEASE_BATCH];  /*!< Runs to release. */
+    size_t cnt;                         /*!< Number in use. */
+    bool pending;                       /*!< Counted as pending free? */
+};
+
+/* Releases the runs in B. */
+static void release_batch_flush(struct release_batch *b) {
+    for (size_t i = 0; i < b->cnt; i++) {
+        if (b->pending) {
+            free_map_release_deferred(b->runs[i].start, b->runs[i].length);
+        } else {
+            free_map_release(b->runs[i].start, b->runs[i].length);
+        }
+    }
+    b->cnt = 0;
+}
+
+/* Adds the LENGTH sectors from START to B, releasing what B holds first
+   if it is full. */
+static void release_batch_add(struct release_batch *b, block_sector_t start,
+                              size_t length) {
+    if (b->cnt > 0 && extent_follows(&b->runs[b->cnt - 1], start)) {
+        b->runs[b->cnt - 1].length += length;
+        return;
+    }
+    if (b->cnt == RELEASE_BATCH) {
+        release_batch_flush(b);
+    }
+    b->runs[b->cnt].start = start;
+    b->runs[b->cnt].length = length;
+    b->cnt++;
+}
+
+/* Frees every sector the file DATA describes holds data or extents in,
+   leaving it with no extents. If PENDING, the sectors were counted as
+   pending free. What was written to its extent blocks is forgotten. */
+static void inode_release_blocks(struct inode_disk *data, bool pending) {
+    struct release_batch batch;
+    batch.cnt = 0;
+    batch.pending = pending;
+
+    for (size_t i = 0; i < data->extent_cnt; i++) {
+        if (data->extents[i].start != 0) {
+            release_batch_add(&batch, data->extents[i].start,
+                data->extents[i].length);
+        }
+    }
+
+    block_sector_t next = data->extent_block;
+    while (next != 0) {
+        const struct extent_block *eb = cache_get(next, false, CACHE_INDEX,
+            NULL);
+        for (size_t i = 0; i < eb->extent_cnt; i++) {
+            if (eb->extents[i].start != 0) {
+                release_batch_add(&batch, eb->extents[i].start,
+                    eb->extents[i].length);
+            }
+        }
+        block_sector_t block = next;
+        next = eb->next;
+        cache_put(eb);
+        cache_discard(block);
+        release_batch_add(&batch, block, 1);
+    }
+    release_batch_flush(&batch);
+
+    data->extent_cnt = 0;
+    data->extent_block = data->extent_tail = 0;
+}
+
+/* Returns the number of sectors inode_release_blocks() would free from
+   the file DATA describes. */
+static size_t inode_count_blocks(const struct inode_disk *data) {
+    size_t cnt = 0;
+    for (size_t i = 0; i < data->extent_cnt; i++) {
+        if (data->extents[i].start != 0) {
+            cnt += data->extents[i].length;
+        }
     }
 
-    cache_read(data->double_indirect, ind, BLOCK_SECTOR_SIZE, 0);
-    cache_read(ind[ind_idx], dir, BLOCK_SECTOR_SIZE, 0);
+    block_sector_t next = data->extent_block;
+    while (next != 0) {
+        const struct extent_block *eb = cache_get(next, false, CACHE_INDEX,
+            NULL);
+        for (size_t i = 0; i < eb->extent_cnt; i++) {
+            if (eb->extents[i].start != 0) {
+                cnt += eb->extents[i].length;
+            }
+        }
+        next = eb->next;
+        cache_put(eb);
+        cnt++;
+    }
+    return cnt;
+}
+
+/*! Frees the sectors of the removed inodes queued for reclaim so far, in
+    the current thread, and waits for any the reclaim thread is freeing.
+    Each inode is freed in a journal handle of its own. */
+void inode_reclaim(void) {
+    for (;;) {
+        journal_begin();
+        lock_acquire(&reclaim_lock);
+
+        lock_acquire(&reclaim_queue_lock);
+        struct inode *inode = NULL;
+        if (!list_empty(&reclaim_queue)) {
+            inode = list_entry(list_pop_front(&reclaim_queue), struct inode,
+                reclaim_elem);
+        }
+        lock_release(&reclaim_queue_lock);
 
-    /* Write all new entries into the indirected sectors. */
-    i = 0;
-    while (i < new_sectors) {
-        dir_idx++;
+        if (inode != NULL) {
+            inode_release_blocks(&inode->data, true);
+            free_map_release_deferred(inode->sector, 1);
+            free(inode);
+        }
 
-        /* If we have consumed of all the current indirected sector, allocate 
-        and start using a new one. */
-        if (dir_idx == NUM_ENTRIES_IN_INDIRECT) {
-            cache_write(ind[ind_idx], dir, BLOCK_SECTOR_SIZE, 0);
-            dir_idx = 0;
-            ind_idx++;
-            ind[ind_idx] = available_sectors[i];
-            i++;
-            memset(dir, 0, BLOCK_SECTOR_SIZE);
+        lock_release(&reclaim_lock);
+        journal_end();
+        if (inode == NULL) {
+            return;
         }
+    }
+}
 
-        /* Give the file a new sector for use. */
-        dir[dir_idx] = available_sectors[i];
+/*! Reclaims removed inodes if fewer than CNT sectors are free but some
+    are pending free, so that an allocation doesn't fail for want of
+    sectors that are about to be freed anyway. */
+void inode_make_room(size_t cnt) {
+    if (free_map_free_count() < cnt && free_map_pending_count() > 0) {
+        inode_reclaim();
+    }
+}
 
-        /* Set newly appended sector to be all zeros. */
-        cache_write(available_sectors[i], zeros, BLOCK_SECTOR_SIZE, 0);
+/* Frees the sectors of removed inodes as they are queued. */
+static void reclaim_thread(void *aux UNUSED) {
+    for (;;) {
+        lock_acquire(&reclaim_queue_lock);
+        while (list_empty(&reclaim_queue)) {
+            cond_wait(&reclaim_queued, &reclaim_queue_lock);
+        }
+        lock_release(&reclaim_queue_lock);
 
-        i++;
+        inode_reclaim();
     }
+}
 
-    /* Finish persisting to disk our changes and free temporary buffers. */
-    cache_write(ind[ind_idx], dir, BLOCK_SECTOR_SIZE, 0);
-    cache_write(data->double_indirect, ind, BLOCK_SECTOR_SIZE, 0);
-    free(dir);
-    free(ind);
-    free(zeros);
+/* A growable list of extents, for rewriting a file's. */
+struct extent_list {
+    struct extent *extents;             /*!< Extents, in file order. */
+    size_t cnt;                         /*!< Number in use. */
+    size_t cap;                         /*!< Number allocated. */
+};
 
+/* Appends the LENGTH sectors from START, or a hole if START is 0, to L,
+   merging them into its last extent if they follow on from it. Returns
+   false if memory is short. */
+static bool extent_list_push(struct extent_list *l, block_sector_t start,
+                             size_t length) {
+    if (l->cnt > 0 && extent_follows(&l->extents[l->cnt - 1], start)) {
+        l->extents[l->cnt - 1].length += length;
+        return true;
+    }
+    if (l->cnt == l->cap) {
+        size_t cap = l->cap > 0 ? l->cap * 2 : INODE_EXTENTS;
+        struct extent *extents = realloc(l->extents, cap * sizeof *extents);
+        if (extents == NULL) {
+            return false;
+        }
+        l->extents = extents;
+        l->cap = cap;
+    }
+    l->extents[l->cnt].start = start;
+    l->extents[l->cnt].length = length;
+    l->cnt++;
     return true;
 }
 
+/* Gives the sectors of INODE in holes that SIZE bytes from OFFSET lie in
+   sectors of their own, so that they can be written. They're zeroed,
+   bar those the range covers whole, which the caller must write while it
+   holds the range locked. The extents go in a new chain of extent
+   blocks, so that only the inode and the free map go by the journal,
+   however long the chain. Returns false if memory or disk space ran
+   out; the holes are then left as they were. */
+static bool inode_fill_holes(struct inode *inode, off_t offset, off_t size) {
+    struct inode_disk *data = &inode->data;
+    enum cache_class class = inode_class(inode);
+    size_t lo = offset / BLOCK_SECTOR_SIZE;
+    size_t hi = bytes_to_sectors(offset + size);
+    size_t whole = DIV_ROUND_UP(offset, BLOCK_SECTOR_SIZE);
+    size_t whole_end = (offset + size) / BLOCK_SECTOR_SIZE;
+    struct extent_list old = { NULL, 0, 0 };
+    struct extent_list new = { NULL, 0, 0 };
+    struct extent_list fresh = { NULL, 0, 0 };
+    struct extent_block *eb = NULL;
+    block_sector_t *blocks = NULL;
+    size_t block_cnt = 0;
+    size_t old_block_cnt;
+    bool success = false;
+
+    inode_make_room(hi - lo);
+    lock_acquire(&inode->extension_lock);
+    ASSERT(!data->is_inline);
+
+    /* Read in the extents, and the extent blocks they're kept in. */
+    for (size_t i = 0; i < data->extent_cnt; i++) {
+        if (!extent_list_push(&old, data->extents[i].start,
+                              data->extents[i].length)) {
+            goto done;
+        }
+    }
+    for (block_sector_t next = data->extent_block; next != 0; ) {
+        block_sector_t *more = realloc(blocks,
+            (block_cnt + 1) * sizeof *blocks);
+        if (more == NULL) {
+            goto done;
+        }
+        blocks = more;
+        blocks[block_cnt++] = next;
+
+        const struct extent_block *eb = cache_get(next, false, CACHE_INDEX,
+            NULL);
+        bool pushed = true;
+        for (size_t i = 0; i < eb->extent_cnt && pushed; i++) {
+            pushed = extent_list_push(&old, eb->extents[i].start,
+                eb->extents[i].length);
+        }
+        next = eb->next;
+        cache_put(eb);
+        if (!pushed) {
+            goto done;
+        }
+    }
+
+    old_block_cnt = block_cnt;
+
+    /* Copy them, splitting the holes the range overlaps around runs of
+       new sectors. */
+    size_t first = 0;
+    bool ok = true;
+    for (size_t i = 0; i < old.cnt && ok; i++) {
+        struct extent *e = &old.extents[i];
+        size_t end = first + e->length;
+
+        if (e->start != 0 || end <= lo || first >= hi) {
+            ok = extent_list_push(&new, e->start, e->length);
+        } else {
+            size_t from = first > lo ? first : lo;
+            size_t to = end < hi ? end : hi;
+            if (from > first) {
+                ok = extent_list_push(&new, 0, from - first);
+            }
+
+            block_sector_t goal = -1;
+            if (new.cnt > 0 && new.extents[new.cnt - 1].start != 0) {
+                struct extent *prev = &new.extents[new.cnt - 1];
+                goal = prev->start + prev->length;
+            }
+            while (ok && from < to) {
+                block_sector_t start;
+                size_t run = free_map_allocate_run(goal, to - from, &start);
+                ok = run > 0 && extent_list_push(&fresh, start, run);
+                if (!ok) {
+                    if (run > 0) {
+                        free_map_release(start, run);
+                    }
+                    break;
+                }
+                for (size_t j = 0; j < run; j++) {
+                    if (from + j < whole || from + j >= whole_end) {
+                        cache_zero(start + j, class, &inode->dirty);
+                    }
+                }
+                ok = extent_list_push(&new, start, run);
+                from += run;
+                goal = start + run;
+            }
+
+            if (ok && end > to) {
+                ok = extent_list_push(&new, 0, end - to);
+            }
+        }
+        first = end;
+    }
+
+    /* Allocate the new extent blocks, after the old ones in BLOCKS. */
+    size_t need_blocks = new.cnt > INODE_EXTENTS
+        ? DIV_ROUND_UP(new.cnt - INODE_EXTENTS, EXTENT_BLOCK_EXTENTS) : 0;
+    if (ok && need_blocks > 0) {
+        eb = malloc(sizeof *eb);
+        ok = eb != NULL;
+    }
+    while (ok && block_cnt < old_block_cnt + need_blocks) {
+        block_sector_t *more = realloc(blocks,
+            (block_cnt + 1) * sizeof *blocks);
+        ok = more != NULL;
+        if (ok) {
+            blocks = more;
+            ok = free_map_allocate_single(&blocks[block_cnt]);
+        }
+        if (ok) {
+            block_cnt++;
+        }
+    }
+    if (!ok) {
+        /* Give back what was allocated, without writing it. */
+        for (size_t i = 0; i < fresh.cnt; i++) {
+            for (size_t j = 0; j < fresh.extents[i].length; j++) {
+                cache_discard(fresh.extents[i].start + j);
+            }
+            free_map_release(fresh.extents[i].start, fresh.extents[i].length);
+        }
+        for (size_t b = old_block_cnt; b < block_cnt; b++) {
+            free_map_release_single(blocks[b]);
+        }
+        goto done;
+    }
+
+    /* Fill in the new chain. Nothing leads to it yet. */
+    block_sector_t *new_blocks = blocks + old_block_cnt;
+    size_t done_cnt = new.cnt < INODE_EXTENTS ? new.cnt : INODE_EXTENTS;
+    for (size_t b = 0; b < need_blocks; b++) {
+        size_t n = new.cnt - done_cnt;
+        if (n > EXTENT_BLOCK_EXTENTS) {
+            n = EXTENT_BLOCK_EXTENTS;
+        }
+        memset(eb, 0, sizeof *eb);
+        memcpy(eb->extents, new.extents + done_cnt, n * sizeof *eb->extents);
+        eb->extent_cnt = n;
+        eb->next = b + 1 < need_blocks ? new_blocks[b + 1] : 0;
+        cache_write_new(new_blocks[b], eb, CACHE_INDEX, &inode->dirty);
+        done_cnt += n;
+    }
+
+    /* Put them in place, while readers that walk the extents wait, and
+       forget those they remembered. */
+    enum intr_level old_level = intr_disable();
+    inode->map_seq++;
+    memset(inode->map, 0, sizeof inode->map);
+    intr_set_level(old_level);
+    barrier();
+
+    data->extent_cnt = new.cnt < INODE_EXTENTS ? new.cnt : INODE_EXTENTS;
+    memcpy(data->extents, new.extents,
+        data->extent_cnt * sizeof *new.extents);
+    data->extent_block = need_blocks > 0 ? new_blocks[0] : 0;
+    data->extent_tail = need_blocks > 0 ? new_blocks[need_blocks - 1] : 0;
+
+    barrier();
+    inode->map_seq++;
+
+    /* The old chain goes once the new one is committed. */
+    for (size_t b = 0; b < old_block_cnt; b++) {
+        free_map_release_single(blocks[b]);
+    }
+    inode_store(inode);
+    success = true;
+
+done:
+    lock_release(&inode->extension_lock);
+    free(old.extents);
+    free(new.extents);
+    free(fresh.extents);
+    free(blocks);
+    free(eb);
+    return success;
+}
+
+/* Writes INODE's copy of its disk inode through to its sector in the
+   cache, so that the journal commits it along with the changes to its
+   extents and the free map that it reflects. */
+static void inode_store(struct inode *inode) {
+    ASSERT(lock_held_by_current_thread(&inode->extension_lock));
+
+    cache_write(inode->sector, &inode->data, BLOCK_SECTOR_SIZE, 0,
+        CACHE_META, &inode->dirty);
+    inode->changed = true;
+}
+
+/* Returns a hash value for the inode containing E. */
+static unsigned inode_hash(const struct hash_elem *e, void *aux UNUSED) {
+    const struct inode *inode = hash_entry(e, struct inode, elem);
+    return hash_int(inode->sector);
+}
+
+/* Returns true if the inode containing A is in a lower sector than the
+   one containing B. */
+static bool inode_less(const struct hash_elem *a, const struct hash_elem *b,
+                       void *aux UNUSED) {
+    return hash_entry(a, struct inode, elem)->sector
+           < hash_entry(b, struct inode, elem)->sector;
+}
 
 /*! Initializes the inode module. */
 void inode_init(void) {
-    list_init(&open_inodes);
+    if (!hash_init(&open_inodes, inode_hash, inode_less, NULL))
+        PANIC("can't allocate open inode table");
+    lock_init(&open_inodes_lock);
+
+    list_init(&reclaim_queue);
+    lock_init(&reclaim_queue_lock);
+    cond_init(&reclaim_queued);
+    lock_init(&reclaim_lock);
+    if (thread_create("inode-reclaim", PRI_DEFAULT, reclaim_thread, NULL)
+        == TID_ERROR)
+        PANIC("can't start inode reclaim thread");
 }
 
-/*! Returns the block device sector that contains byte offset POS
-    within INODE.
-    Returns -1 if INODE does not contain data for a byte at offset
-    POS. */
-static block_sector_t byte_to_sector(const struct inode *inode, off_t pos) {
+/*! Returns the number of inodes open. */
+size_t inode_open_count(void) {
+    lock_acquire(&open_inodes_lock);
+    size_t cnt = hash_size(&open_inodes);
+    lock_release(&open_inodes_lock);
+    return cnt;
+}
+
+/* Looks for the extent holding file block BLOCK among the EXTENT_CNT
+   EXTENTS, the first of which holds file block *FIRST. Stores it in *M
+   and returns true if found; otherwise advances *FIRST past them and
+   returns false. EXTENT_CNT is trusted no further than MAX_CNT, since
+   an extent block may be reused while a reader looks through it. */
+static bool extent_find(const struct extent *extents, size_t extent_cnt,
+                        size_t max_cnt, size_t block, size_t *first,
+                        struct extent_map *m) {
+    if (extent_cnt > max_cnt) {
+        extent_cnt = max_cnt;
+    }
+    for (size_t e = 0; e < extent_cnt; e++) {
+        if (block - *first < extents[e].length) {
+            m->first = *first;
+            m->extent = extents[e];
+            return true;
+        }
+        *first += extents[e].length;
+    }
+    return false;
+}
+
+/* Finds the extent of INODE that holds file block BLOCK, which may be a
+   hole, and stores it in *M. Returns false if the file doesn't reach
+   BLOCK. The extents used most recently are remembered, so that
+   sequential and repeated access don't walk the extent list, or read
+   extent blocks, again. */
+static bool inode_map_block(struct inode *inode, size_t block,
+                            struct extent_map *m) {
+    const struct inode_disk *data = &inode->data;
+    enum intr_level old_level;
+    bool found = false;
+    unsigned seq;
+
+    if (data->is_inline) {
+        return false;
+    }
+
+    /* The map is shared by readers that hold no lock, and is small enough
+       to look through with interrupts off. */
+    old_level = intr_disable();
+    for (size_t i = 0; i < INODE_MAP_SIZE && !found; i++) {
+        if (block - inode->map[i].first < inode->map[i].extent.length) {
+            *m = inode->map[i];
+            found = true;
+        }
+    }
+    intr_set_level(old_level);
+    if (found) {
+        return true;
+    }
+
+    /* Walk the extents, again if holes were filled in meanwhile. The
+       extents only change behind the extension_lock, so wait on that
+       while they are. */
+    do {
+        while ((seq = inode->map_seq) & 1) {
+            lock_acquire(&inode->extension_lock);
+            lock_release(&inode->extension_lock);
+        }
+        barrier();
+
+        size_t first = 0;
+        found = extent_find(data->extents, data->extent_cnt, INODE_EXTENTS,
+            block, &first, m);
+        block_sector_t next = data->extent_block;
+        while (!found && next != 0) {
+            const struct extent_block *eb = cache_get(next, false,
+                CACHE_INDEX, NULL);
+            found = extent_find(eb->extents, eb->extent_cnt,
+                EXTENT_BLOCK_EXTENTS, block, &first, m);
+            next = eb->next;
+            cache_put(eb);
+        }
+        barrier();
+    } while (inode->map_seq != seq);
+
+    if (found) {
+        old_level = intr_disable();
+        if (inode->map_seq == seq) {
+            inode->map[inode->map_next] = *m;
+            inode->map_next = (inode->map_next + 1) % INODE_MAP_SIZE;
+        }
+        intr_set_level(old_level);
+    }
+    return found;
+}
+
+/*! Stores in SECTORS the block device sectors that hold CNT consecutive
+    sectors' worth of INODE's data, starting with the one containing byte
+    offset POS. Stores -1 for those that INODE has no data for, because
+    they're in a hole or past its end, which is all of them if its data
+    is inline. */
+static void byte_range_to_sectors(struct inode *inode, off_t pos,
+                                  size_t cnt, block_sector_t *sectors) {
     ASSERT(inode != NULL);
     ASSERT(inode->data.magic == INODE_MAGIC);
-    
-    /* Get indirection indices that point to the correct sector. */
-    size_t dir_idx, ind_idx;
-    indices_from_offset(pos, &dir_idx, &ind_idx);
-    block_sector_t sector;
 
-    /* Temporary buffer to story indirection tables. */
-    block_sector_t *buffer = malloc(sizeof(block_sector_t));
-    
-    /* Find the single-indirect table from the double-indirect, if it exists. */
-    cache_read(inode->data.double_indirect, buffer, sizeof(block_sector_t), 
-        sizeof(block_sector_t) * ind_idx);
-    sector = *buffer;
+    size_t block = pos / BLOCK_SECTOR_SIZE;
+    size_t i = 0;
+    struct extent_map m;
 
-    /* It doesn't exist, so return -1. */
-    if (!sector) {
-        free(buffer);
-        return -1;
+    while (i < cnt && inode_map_block(inode, block + i, &m)) {
+        for (size_t j = block + i - m.first; j < m.extent.length && i < cnt;
+             j++) {
+            sectors[i++] = m.extent.start != 0 ? m.extent.start + j
+                                               : (block_sector_t) -1;
+        }
     }
 
-    /* Find the single-direct sector from the single-indirect, if it exists. */
-    cache_read(sector, buffer, sizeof(block_sector_t), 
-        sizeof(block_sector_t) * dir_idx);
-    sector = *buffer;
-    free(buffer);
-
-    /* It doesn't exist, so return -1. */
-    if (!sector) {
-        return -1;
+    for (; i < cnt; i++) {
+        sectors[i] = -1;
     }
+}
 
+/*! Returns the block device sector that contains byte offset POS
+    within INODE.
+    Returns -1 if INODE does not contain data for a byte at offset
+    POS. */
+static block_sector_t byte_to_sector(struct inode *inode, off_t pos) {
+    block_sector_t sector;
+    byte_range_to_sectors(inode, pos, 1, &sector);
     return sector;
 }
 
-/* Essentially a function for debugging purposes. Prints all sectors of a file 
-that the inode links to. */
+/* Zeroes the sectors of file blocks LO up to HI of INODE that aren't in
+   holes. */
+static void inode_zero_blocks(struct inode *inode, size_t lo, size_t hi) {
+    for (size_t b = lo; b < hi; b++) {
+        block_sector_t sector = byte_to_sector(inode,
+            (off_t) b * BLOCK_SECTOR_SIZE);
+        if ((int) sector != CACHE_SECTOR_EMPTY) {
+            cache_zero(sector, inode_class(inode), &inode->dirty);
+        }
+    }
+}
+
+/* Essentially a function for debugging purposes. Prints the extents of a
+file, as start+length. */
 static void print_inode_allocation(struct inode_disk *data) {
     ASSERT(data != NULL);
     ASSERT(data->magic == INODE_MAGIC);
 
-    int i;
-
-    block_sector_t *ind = malloc(BLOCK_SECTOR_SIZE);
-    ASSERT(ind);
-    block_sector_t *dir = malloc(BLOCK_SECTOR_SIZE);
-    ASSERT(dir);
+    if (data->is_inline) {
+        printf("inline: %d bytes\n", data->length);
+        return;
+    }
 
-    cache_read(data->double_indirect, ind, BLOCK_SECTOR_SIZE, 0);
-    while (*ind) {
-        printf("%d:", *ind);
-        cache_read(*ind, dir, BLOCK_SECTOR_SIZE, 0);
-        for (i = 0; i < NUM_ENTRIES_IN_INDIRECT; i++) {
-            if (!*(dir + i)) {
-                break;
-            }
-            printf(" %d", *(dir + i));
+    for (size_t i = 0; i < data->extent_cnt; i++) {
+        printf(" %u+%u", data->extents[i].start, data->extents[i].length);
+    }
+    printf("\n");
+
+    block_sector_t next = data->extent_block;
+    while (next != 0) {
+        printf("%u:", next);
+        const struct extent_block *eb = cache_get(next, false, CACHE_INDEX,
+            NULL);
+        for (size_t i = 0; i < eb->extent_cnt; i++) {
+            printf(" %u+%u", eb->extents[i].start, eb->extents[i].length);
         }
+        next = eb->next;
+        cache_put(eb);
         printf("\n");
-        if (i != NUM_ENTRIES_IN_INDIRECT) {
-            break;
-        }
-        ind++;
     }
 }
 
@@ -300,103 +1074,139 @@ bool inode_create(block_sector_t sector, off_t length, bool is_directory) {
     /* If this assertion fails, the inode structure is not exactly
        one sector in size, and you should fix that. */
     ASSERT(sizeof *disk_inode == BLOCK_SECTOR_SIZE);
+    ASSERT(sizeof (struct extent_block) == BLOCK_SECTOR_SIZE);
 
+    journal_begin();
     disk_inode = calloc(1, sizeof *disk_inode);
     if (disk_inode != NULL) {
         disk_inode->length = 0;
         disk_inode->magic = INODE_MAGIC;
+        disk_inode->format = INODE_FORMAT;
         disk_inode->is_directory = is_directory;
-
-        /* Create multilevel indirection into inode. */
-        block_sector_t *zeros = calloc(1, BLOCK_SECTOR_SIZE);
-        block_sector_t ind_sector, dir_sector;
-
-        if (zeros != NULL) {
-            /* Allocate the first double-indirect and indirect tables (0, 0). */
-            if (free_map_allocate_single(&disk_inode->double_indirect)) {
-                if (free_map_allocate_single(&ind_sector)) {
-                    if (free_map_allocate_single(&dir_sector)) {
-                        success = true;
-                    } else {
-                        free_map_release_single(disk_inode->double_indirect);
-                        free_map_release_single(ind_sector);
-                    }
-                } else {
-                    free_map_release_single(disk_inode->double_indirect);
-                }
-            }
-            /* Write the sector values to these tables corresponding to the 
-            allocations. */
-            if (success) {
-                /* Write the tables to disk, with the appropriate sector 
-                of the indirect table in the double-indirect table. */
-                cache_write(dir_sector, zeros, BLOCK_SECTOR_SIZE, 0);
-                *zeros = dir_sector;
-                cache_write(ind_sector, zeros, BLOCK_SECTOR_SIZE, 0);
-                *zeros = ind_sector;
-                cache_write(disk_inode->double_indirect, zeros, 
-                    BLOCK_SECTOR_SIZE, 0);
-            }
-            free(zeros);
-
-            /* Now allocate the space for the file contents (beyond (0, 0)). */
-            if (success && !inode_extend_file(disk_inode, length)) {
-                /* If the allocation fails, release sectors used by inode. */
-                free_map_release_single(ind_sector);
-                free_map_release_single(disk_inode->double_indirect);
-                success = false;
-            } else {
-                /* Else, all allocations succeeded, so write inode to disk. */
-                cache_write(sector, disk_inode, BLOCK_SECTOR_SIZE, 0);
-            }
+        disk_inode->is_inline = true;
+
+        /* Allocate the space for the file contents, if it doesn't fit
+           inline. */
+        if (inode_extend_file(disk_inode, length, length,
+                              inode_disk_class(disk_inode), NULL, NULL)) {
+            cache_write_new(sector, disk_inode, CACHE_META, NULL);
+            success = true;
+        } else {
+            /* If the allocation fails, release sectors used by inode. */
+            inode_release_blocks(disk_inode, false);
         }
         free(disk_inode);
     }
+    journal_end();
 
     return success;
 }
 
 /*! Reads an inode from SECTOR
     and returns a `struct inode' that contains it.
-    Returns a null pointer if memory allocation fails. */
+    Returns a null pointer if memory allocation fails or if SECTOR
+    does not hold an inode of the current on-disk format. */
 struct inode * inode_open(block_sector_t sector) {
-    struct list_elem *e; 
+    struct inode key;
+    struct hash_elem *e;
     struct inode *inode;
 
+    lock_acquire(&open_inodes_lock);
+
     /* Check whether this inode is already open. */
-    for (e = list_begin(&open_inodes); e != list_end(&open_inodes);
-         e = list_next(e)) {
-        inode = list_entry(e, struct inode, elem);
-        if (inode->sector == sector) {
-            inode_reopen(inode);
-            return inode; 
+    key.sector = sector;
+    while ((e = hash_find(&open_inodes, &key.elem)) != NULL) {
+        inode = hash_entry(e, struct inode, elem);
+        if (!inode->busy) {
+            inode->open_cnt++;
+            lock_release(&open_inodes_lock);
+            return inode;
         }
+        cond_wait(&inode->settled, &open_inodes_lock);
     }
 
     /* Allocate memory. */
     inode = malloc(sizeof *inode);
-    if (inode == NULL)
+    if (inode == NULL) {
+        lock_release(&open_inodes_lock);
         return NULL;
+    }
 
-    /* Initialize. */
-    list_push_front(&open_inodes, &inode->elem);
+    /* Others who open it wait while it is read in. */
     inode->sector = sector;
     inode->open_cnt = 1;
+    inode->busy = true;
+    cond_init(&inode->settled);
+    hash_insert(&open_inodes, &inode->elem);
+    lock_release(&open_inodes_lock);
+
+    /* Initialize. */
     inode->deny_write_cnt = 0;
     inode->removed = false;
     inode->file_count = 0;
+    inode->dir_seq = 0;
+    inode->metadata = false;
     lock_init(&inode->extension_lock);
+    range_lock_init(&inode->ranges);
     lock_init(&inode->dir_lock);
-    cache_read(inode->sector, &inode->data, BLOCK_SECTOR_SIZE, 0);
-    ASSERT(inode->data.magic == INODE_MAGIC);
+    cache_owner_init(&inode->dirty);
+    cache_read(inode->sector, &inode->data, BLOCK_SECTOR_SIZE, 0,
+        CACHE_META);
+    if (inode->data.magic != INODE_MAGIC
+        || inode->data.format != INODE_FORMAT) {
+        /* Not an inode this kernel can read; withdraw the placeholder. */
+        lock_acquire(&open_inodes_lock);
+        hash_delete(&open_inodes, &inode->elem);
+        cond_broadcast(&inode->settled, &open_inodes_lock);
+        lock_release(&open_inodes_lock);
+        free(inode);
+        return NULL;
+    }
+    /* Changes made through an earlier opening may not be committed. */
+    inode->changed = true;
+    inode->synced_length = -1;
+    memset(inode->map, 0, sizeof inode->map);
+    inode->map_next = 0;
+    inode->map_seq = 0;
+    inode->prealloc.start = 0;
+    inode->prealloc.length = 0;
+
+    lock_acquire(&open_inodes_lock);
+    inode->busy = false;
+    cond_broadcast(&inode->settled, &open_inodes_lock);
+    lock_release(&open_inodes_lock);
     return inode;
 }
 
+/*! Marks INODE as holding the file system's own bookkeeping, such as the
+    free map, so that the buffer cache treats its data as metadata. */
+void inode_set_metadata(struct inode *inode) {
+    ASSERT(inode != NULL);
+    inode->metadata = true;
+}
+
+/* Returns how many of SIZE bytes from OFFSET lie within the longest a
+   file can be. */
+static off_t inode_clip(off_t size, off_t offset) {
+    if (offset < 0 || offset >= INODE_MAX_LENGTH || size < 0) {
+        return 0;
+    }
+    return size < INODE_MAX_LENGTH - offset ? size
+                                            : INODE_MAX_LENGTH - offset;
+}
+
+/*! Returns the kind of data INODE holds, for the buffer cache. */
+static enum cache_class inode_class(const struct inode *inode) {
+    return inode->metadata ? CACHE_META : inode_disk_class(&inode->data);
+}
+
 /*! Reopens and returns INODE. */
 struct inode * inode_reopen(struct inode *inode) {
     if (inode != NULL) {
         ASSERT(inode->data.magic == INODE_MAGIC);
+        lock_acquire(&open_inodes_lock);
         inode->open_cnt++;
+        lock_release(&open_inodes_lock);
     }
     return inode;
 }
@@ -413,8 +1223,6 @@ block_sector_t inode_get_inumber(const struct inode *inode) {
     If this was the last reference to INODE, frees its memory.
     If INODE was also a removed inode, frees its blocks. */
 void inode_close(struct inode *inode) {
-
-    int i;
     /* Ignore null pointer. */
     if (inode == NULL)
         return;
@@ -422,46 +1230,38 @@ void inode_close(struct inode *inode) {
     ASSERT(inode->data.magic == INODE_MAGIC);
 
     /* Release resources if this was the last opener. */
-    if (--inode->open_cnt == 0) {
-        /* Remove from inode list and release lock. */
-        list_remove(&inode->elem);
- 
-        /* Persist changes to inode to disk. */
-        cache_write(inode->sector, &inode->data, BLOCK_SECTOR_SIZE, 0);
-
-        /* Deallocate blocks if removed. */
-        if (inode->removed) {
-            block_sector_t *ind = malloc(BLOCK_SECTOR_SIZE);
-            ASSERT(ind);
-            block_sector_t *dir = malloc(BLOCK_SECTOR_SIZE);
-            ASSERT(dir);
-
-            cache_read(inode->data.double_indirect, ind, BLOCK_SECTOR_SIZE, 0);
-            while (*ind) {
-                cache_read(*ind, dir, BLOCK_SECTOR_SIZE, 0);
-                for (i = 0; i < NUM_ENTRIES_IN_INDIRECT; i++) {
-                    if (*(dir + i)) {
-                        break;
-                    }
-                    /* Free the direct (file contents) sector. */
-                    free_map_release_single(*(dir + i));
-                }
-                /* Free the single indirect sector. */
-                free_map_release_single(*ind);
-                if (i != NUM_ENTRIES_IN_INDIRECT) {
-                    break;
-                }
-                ind++;
-            }
-
-            /* Free the double indirect sector. */
-            free_map_release_single(inode->data.double_indirect);
-
-            /* Free inode itself. */
-            free_map_release_single(inode->sector);
+    lock_acquire(&open_inodes_lock);
+    bool last = --inode->open_cnt == 0;
+    if (last) {
+        inode->busy = true;
+    }
+    lock_release(&open_inodes_lock);
+
+    if (last) {
+        /* Every change to the inode has gone through to its sector in the
+           cache already, so it's ready for anyone who opens it afresh.
+           Its dirty sectors outlive it, and are left to write behind. */
+        lock_acquire(&open_inodes_lock);
+        hash_delete(&open_inodes, &inode->elem);
+        cond_broadcast(&inode->settled, &open_inodes_lock);
+        lock_release(&open_inodes_lock);
+
+        cache_owner_release(&inode->dirty);
+        if (inode->prealloc.length > 0) {
+            free_map_unreserve(inode->prealloc.start, inode->prealloc.length);
         }
 
-        free(inode); 
+        /* Deallocate blocks if removed: the reclaim thread frees them,
+           and the inode itself, so that closing a large file is quick. */
+        if (inode->removed) {
+            free_map_defer(inode_count_blocks(&inode->data) + 1);
+            lock_acquire(&reclaim_queue_lock);
+            list_push_back(&reclaim_queue, &inode->reclaim_elem);
+            cond_signal(&reclaim_queued, &reclaim_queue_lock);
+            lock_release(&reclaim_queue_lock);
+        } else {
+            free(inode);
+        }
     }
 }
 
@@ -485,41 +1285,146 @@ bool inode_is_removed(struct inode *inode) {
    Returns the number of bytes actually read, which may be less
    than SIZE if an error occurs or end of file is reached. */
 off_t inode_read_at(struct inode *inode, void *buffer_, off_t size, off_t offset) {
+    return inode_read_stream(inode, buffer_, size, offset, NULL);
+}
+
+/*! Initializes RA for a new reader, which isn't known to be sequential. */
+void inode_read_ahead_init(struct read_ahead *ra) {
+    ra->next = 0;
+    ra->issued = 0;
+    ra->window = 0;
+}
+
+/* Updates RA for a read of SIZE bytes at OFFSET within INODE, and queues
+   whatever the read-ahead window now covers that isn't queued already.
+   Each sequential read doubles the window, up to READ_AHEAD_MAX sectors
+   or as many as the cache keeps prefetched sectors for, whichever is
+   less; each random read halves it, and it closes once it's under
+   READ_AHEAD_MIN. */
+static void read_ahead(struct inode *inode, struct read_ahead *ra,
+                       off_t offset, off_t size) {
+    size_t max = cache_read_ahead_max();
+    if (max > READ_AHEAD_MAX) {
+        max = READ_AHEAD_MAX;
+    }
+    if (max < READ_AHEAD_MIN) {
+        max = READ_AHEAD_MIN;
+    }
+
+    if (offset == ra->next) {
+        ra->window = ra->window == 0 ? READ_AHEAD_MIN : ra->window * 2;
+        if (ra->window > max) {
+            ra->window = max;
+        }
+    } else {
+        ra->window /= 2;
+        if (ra->window < READ_AHEAD_MIN) {
+            ra->window = 0;
+        }
+        ra->issued = 0;
+    }
+    ra->next = offset + size;
+
+    if (ra->window == 0) {
+        return;
+    }
+
+    /* Prefetch whole sectors past the end of this read, within the file. */
+    off_t start = ROUND_UP(ra->next, BLOCK_SECTOR_SIZE);
+    off_t end = start + (off_t) ra->window * BLOCK_SECTOR_SIZE;
+    if (end > inode_length(inode)) {
+        end = inode_length(inode);
+    }
+    if (start < ra->issued) {
+        start = ra->issued;
+    }
+
+    for (off_t pos = start; pos < end; pos += BLOCK_SECTOR_SIZE) {
+        block_sector_t sector = byte_to_sector(inode, pos);
+        if ((int) sector != CACHE_SECTOR_EMPTY) {
+            cache_prefetch(sector, inode_class(inode));
+        }
+    }
+    if (end > ra->issued) {
+        ra->issued = end;
+    }
+}
+
+/*! Like inode_read_at(), but RA, if not null, tracks whether successive
+   calls read sequentially, and if so the sectors that follow are read
+   ahead in the background. */
+off_t inode_read_stream(struct inode *inode, void *buffer_, off_t size,
+                        off_t offset, struct read_ahead *ra) {
     ASSERT(inode != NULL);
     ASSERT(inode->data.magic == INODE_MAGIC);
 
     uint8_t *buffer = buffer_;
-    off_t bytes_read = 0;
+    off_t start = offset;
+    enum cache_class class = inode_class(inode);
+    struct range range;
 
-    while (size > 0) {
-        /* Disk sector to read, starting byte offset within sector. */
-        block_sector_t sector_idx = byte_to_sector (inode, offset);
+    size = inode_clip(size, offset);
 
-        int sector_ofs = offset % BLOCK_SECTOR_SIZE;
+    /* Keep writers to the same bytes out until we're done. */
+    range_lock_acquire(&inode->ranges, &range, offset, offset + size, false);
 
-        /* Bytes left in inode, bytes left in sector, lesser of the two. */
-        off_t inode_left = inode_length(inode) - offset;
-        int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
-        int min_left = inode_left < sector_left ? inode_left : sector_left;
+    /* Don't read past the end of the file. */
+    off_t inode_left = inode_length(inode) - offset;
+    if (size > inode_left) {
+        size = inode_left > 0 ? inode_left : 0;
+    }
 
-        /* Number of bytes to actually copy out of this sector. */
-        int chunk_size = size < min_left ? size : min_left;
-        if (chunk_size <= 0)
-            break;
+    /* Small files are read straight out of the inode. */
+    if (inode_inline_io(inode, buffer, size, offset, false)) {
+        range_lock_release(&inode->ranges, &range);
+        return size;
+    }
 
-        /* Don't read from an invalid sector. */
-        if ((int)sector_idx == CACHE_SECTOR_EMPTY) {
+    while (size > 0) {
+        /* Sectors the next batch of the range lies in. */
+        size_t cnt = DIV_ROUND_UP(offset % BLOCK_SECTOR_SIZE + size,
+                                  BLOCK_SECTOR_SIZE);
+        if (cnt > CACHE_RANGE_BATCH) {
+            cnt = CACHE_RANGE_BATCH;
+        }
+        block_sector_t sectors[CACHE_RANGE_BATCH];
+        byte_range_to_sectors(inode, offset, cnt, sectors);
+
+        /* Read each run of sectors that exist in one go, and zeros in
+           place of those that don't. */
+        struct cache_segment segs[CACHE_RANGE_BATCH];
+        size_t seg_cnt = 0;
+        uint8_t *run = buffer;
+
+        for (size_t i = 0; i < cnt && size > 0; i++) {
+            int sector_ofs = offset % BLOCK_SECTOR_SIZE;
+            int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
+            int chunk_size = size < sector_left ? size : sector_left;
+
+            if ((int) sectors[i] == CACHE_SECTOR_EMPTY) {
+                cache_read_range(segs, seg_cnt, run, class);
+                seg_cnt = 0;
+                memset(buffer, 0, chunk_size);
+                run = buffer + chunk_size;
+            } else {
+                segs[seg_cnt].sector = sectors[i];
+                segs[seg_cnt].offset = sector_ofs;
+                segs[seg_cnt].size = chunk_size;
+                seg_cnt++;
+            }
+
+            /* Advance. */
             size -= chunk_size;
             offset += chunk_size;
-            continue;
-        } 
+            buffer += chunk_size;
+        }
+        cache_read_range(segs, seg_cnt, run, class);
+    }
+    range_lock_release(&inode->ranges, &range);
 
-        cache_read(sector_idx, buffer + bytes_read, chunk_size, sector_ofs);
-      
-        /* Advance. */
-        size -= chunk_size;
-        offset += chunk_size;
-        bytes_read += chunk_size;
+    off_t bytes_read = offset - start;
+    if (ra != NULL) {
+        read_ahead(inode, ra, start, bytes_read);
     }
     return bytes_read;
 }
@@ -538,9 +1443,24 @@ off_t inode_write_at(struct inode *inode, const void *buffer_, off_t size,
     if (inode->deny_write_cnt)
         return 0;
 
+    size = inode_clip(size, offset);
+    if (size == 0)
+        return 0;
+
+    /* Growing the file, and writing to a directory or into a hole, change
+       metadata that must be committed together. */
+    journal_begin();
+
     /* If we are writing beyond the file’s length (in sectors), we might be
     extending the file. */
     off_t write_position = offset + size;
+    off_t old_length = write_position;
+
+    /* Only the bytes written are locked, even when extending: writers
+       elsewhere in the file, and other appenders, only wait on the
+       extension_lock while sectors are allocated. */
+    struct range range;
+    range_lock_acquire(&inode->ranges, &range, offset, write_position, true);
 
    /* Note that this condition doesn’t guarentee a new sector is needed,
     but in case it isn’t inode_extend_file(). */
@@ -550,37 +1470,251 @@ off_t inode_write_at(struct inode *inode, const void *buffer_, off_t size,
 
         if (write_position > inode->data.length) {
             /* We are, so extend the file. */
-            inode_extend_file(&inode->data, write_position-inode->data.length);
+            old_length = inode->data.length;
+            inode_extend_file(&inode->data, write_position-inode->data.length,
+                offset, inode_class(inode), &inode->dirty, &inode->prealloc);
+            inode_store(inode);
         }
         lock_release(&inode->extension_lock);
     }
 
+    /* Don't write past the end of the file, should extension fail. */
+    off_t inode_left = inode_length(inode) - offset;
+    if (size > inode_left) {
+        size = inode_left > 0 ? inode_left : 0;
+    }
+
+    /* Small files are written straight into the inode. */
+    if (inode_inline_io(inode, (void *) buffer, size, offset, true)) {
+        range_lock_release(&inode->ranges, &range);
+        journal_end();
+        return size;
+    }
+
     while (size > 0) {
-        /* Sector to write, starting byte offset within sector. */
-        block_sector_t sector_idx = byte_to_sector(inode, offset);
+        /* Sectors the next batch of the range lies in. */
+        size_t cnt = DIV_ROUND_UP(offset % BLOCK_SECTOR_SIZE + size,
+                                  BLOCK_SECTOR_SIZE);
+        if (cnt > CACHE_RANGE_BATCH) {
+            cnt = CACHE_RANGE_BATCH;
+        }
+        block_sector_t sectors[CACHE_RANGE_BATCH];
+        byte_range_to_sectors(inode, offset, cnt, sectors);
+
+        struct cache_segment segs[CACHE_RANGE_BATCH];
+        size_t seg_cnt = 0;
+        off_t batch_size = 0;
+        bool hole = false;
+
+        for (size_t i = 0; i < cnt && size > 0; i++) {
+            int sector_ofs = offset % BLOCK_SECTOR_SIZE;
+            int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
+            int chunk_size = size < sector_left ? size : sector_left;
+
+            /* Sectors in a hole get their own once those before them
+               are written. */
+            if ((int) sectors[i] == CACHE_SECTOR_EMPTY) {
+                hole = true;
+                break;
+            }
 
-        int sector_ofs = offset % BLOCK_SECTOR_SIZE;
+            segs[seg_cnt].sector = sectors[i];
+            segs[seg_cnt].offset = sector_ofs;
+            segs[seg_cnt].size = chunk_size;
+            seg_cnt++;
 
-        /* Bytes left in inode, bytes left in sector, lesser of the two. */
-        off_t inode_left = inode_length(inode) - offset;
-        int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
-        int min_left = inode_left < sector_left ? inode_left : sector_left;
+            /* Advance. */
+            size -= chunk_size;
+            offset += chunk_size;
+            batch_size += chunk_size;
+        }
 
-        /* Number of bytes to actually write into this sector. */
-        int chunk_size = size < min_left ? size : min_left;
-        if (chunk_size <= 0)
+        cache_write_range(segs, seg_cnt, buffer + bytes_written,
+            inode_class(inode), &inode->dirty);
+        bytes_written += batch_size;
+
+        if (hole && !inode_fill_holes(inode, offset, size)) {
+            /* The extension left the sectors past the old end that this
+               write covers whole for it to fill, and it won't. */
+            off_t from = old_length > offset ? old_length : offset;
+            inode_zero_blocks(inode, DIV_ROUND_UP(from, BLOCK_SECTOR_SIZE),
+                write_position / BLOCK_SECTOR_SIZE);
             break;
+        }
+    }
 
+    range_lock_release(&inode->ranges, &range);
+    journal_end();
+    return bytes_written;
+}
 
-        cache_write(sector_idx, buffer + bytes_written, chunk_size, sector_ofs);
+/*! Replaces the contents of INODE with the SIZE bytes in BUFFER. They're
+    written to new sectors, which take the place of the old ones at once,
+    so that however long the file, a crash leaves either all of the old
+    contents or all of the new, and only the inode and the free map go
+    by the journal. Returns false, leaving INODE as it was, if memory or
+    disk space ran out. */
+bool inode_replace(struct inode *inode, const void *buffer, off_t size) {
+    ASSERT(inode != NULL);
+    ASSERT(inode->data.magic == INODE_MAGIC);
+    ASSERT(size <= INODE_MAX_LENGTH);
 
-        /* Advance. */
-        size -= chunk_size;
-        offset += chunk_size;
-        bytes_written += chunk_size;
+    enum cache_class class = inode_class(inode);
+    struct inode_disk *disk = calloc(1, sizeof *disk);
+    if (disk == NULL) {
+        return false;
     }
 
-    return bytes_written;
+    journal_begin();
+
+    /* Build the new extents in DISK, and write the new contents. Nothing
+       leads to them yet. */
+    size_t cnt = bytes_to_sectors(size);
+    if (inode_allocate(disk, cnt, false, class, &inode->dirty, NULL) < cnt) {
+        inode_release_blocks(disk, false);
+        journal_end();
+        free(disk);
+        return false;
+    }
+    const uint8_t *p = buffer;
+    off_t left = size;
+    extents_write(disk->extents, disk->extent_cnt, &p, &left, class,
+        &inode->dirty);
+    for (block_sector_t next = disk->extent_block; next != 0; ) {
+        const struct extent_block *eb = cache_get(next, false, CACHE_INDEX,
+            NULL);
+        extents_write(eb->extents, eb->extent_cnt, &p, &left, class,
+            &inode->dirty);
+        next = eb->next;
+        cache_put(eb);
+    }
+
+    /* Swap them for the old ones, which DISK is left with, while readers
+       and writers of the file wait. */
+    struct range range;
+    range_lock_acquire(&inode->ranges, &range, 0, INODE_MAX_LENGTH, true);
+    lock_acquire(&inode->extension_lock);
+
+    enum intr_level old_level = intr_disable();
+    inode->map_seq++;
+    memset(inode->map, 0, sizeof inode->map);
+    intr_set_level(old_level);
+    barrier();
+
+    struct inode_disk *data = &inode->data;
+    bool was_inline = data->is_inline;
+    for (size_t i = 0; i < INODE_EXTENTS; i++) {
+        struct extent e = data->extents[i];
+        data->extents[i] = disk->extents[i];
+        disk->extents[i] = e;
+    }
+    uint32_t extent_cnt = data->extent_cnt;
+    block_sector_t extent_block = data->extent_block;
+    block_sector_t extent_tail = data->extent_tail;
+    data->extent_cnt = disk->extent_cnt;
+    data->extent_block = disk->extent_block;
+    data->extent_tail = disk->extent_tail;
+    disk->extent_cnt = extent_cnt;
+    disk->extent_block = extent_block;
+    disk->extent_tail = extent_tail;
+    data->is_inline = false;
+    data->length = size;
+
+    barrier();
+    inode->map_seq++;
+    inode_store(inode);
+    lock_release(&inode->extension_lock);
+    range_lock_release(&inode->ranges, &range);
+
+    /* The old sectors go once the new ones are committed. */
+    if (!was_inline) {
+        inode_release_blocks(disk, false);
+    }
+    journal_end();
+    free(disk);
+    return true;
+}
+
+/* Writes the contents of sectors just allocated for CNT EXTENTS from
+   *BUFFER, of which *SIZE bytes are left, advancing both past what was
+   written. The sectors hold CLASS of data and belong to OWNER. */
+static void extents_write(const struct extent *extents, size_t cnt,
+                          const uint8_t **buffer, off_t *size,
+                          enum cache_class class,
+                          struct cache_owner *owner) {
+    for (size_t i = 0; i < cnt; i++) {
+        for (size_t j = 0; j < extents[i].length && *size > 0; j++) {
+            block_sector_t sector = extents[i].start + j;
+            off_t chunk = *size < BLOCK_SECTOR_SIZE ? *size
+                                                    : BLOCK_SECTOR_SIZE;
+            if (chunk == BLOCK_SECTOR_SIZE) {
+                cache_write_new(sector, *buffer, class, owner);
+            } else {
+                cache_zero(sector, class, owner);
+                cache_write(sector, *buffer, chunk, 0, class, owner);
+            }
+            *buffer += chunk;
+            *size -= chunk;
+        }
+    }
+}
+
+/* If INODE's data is inline, copies SIZE bytes at OFFSET within it to
+   BUFFER, or if WRITE from BUFFER, and returns true. Written bytes go
+   through to the inode's sector in the cache as well. Returns false,
+   doing nothing, if INODE's data is kept in extents. */
+static bool inode_inline_io(struct inode *inode, void *buffer, off_t size,
+                            off_t offset, bool write) {
+    if (!inode->data.is_inline) {
+        return false;
+    }
+
+    /* Hold the data in place against a move out of the inode. */
+    lock_acquire(&inode->extension_lock);
+    bool is_inline = inode->data.is_inline;
+    if (is_inline && size > 0) {
+        ASSERT(offset + size <= INODE_INLINE_MAX);
+        if (write) {
+            memcpy(inode->data.inline_data + offset, buffer, size);
+            cache_write(inode->sector, buffer, size,
+                offsetof(struct inode_disk, inline_data) + offset,
+                CACHE_META, &inode->dirty);
+            inode->changed = true;
+        } else {
+            memcpy(buffer, inode->data.inline_data + offset, size);
+        }
+    }
+    lock_release(&inode->extension_lock);
+    return is_inline;
+}
+
+/*! Writes INODE's dirty sectors back to disk, in ascending order, without
+    waiting on anyone else's. The inode itself goes by way of a journal
+    commit, if it has changed since the last; if DATA_ONLY, only if its
+    length has changed too, since only then is it needed to read the data
+    back. No commit is made if the caller has a handle open. Returns false
+    if the flush could not be carried out. */
+bool inode_flush(struct inode *inode, bool data_only) {
+    ASSERT(inode != NULL);
+    ASSERT(inode->data.magic == INODE_MAGIC);
+
+    if (!cache_owner_flush(&inode->dirty)) {
+        return false;
+    }
+
+    lock_acquire(&inode->extension_lock);
+    bool commit = inode->changed
+        && (!data_only || inode->data.length != inode->synced_length);
+    if (commit) {
+        inode->changed = false;
+        inode->synced_length = inode->data.length;
+    }
+    lock_release(&inode->extension_lock);
+
+    if (commit) {
+        journal_commit();
+    }
+    return true;
 }
 
 /*! Disables writes to INODE.
@@ -654,3 +1788,35 @@ void directory_release(struct inode *inode) {
     lock_release(&inode->dir_lock);
 }
 
+/* Returns the sequence count of directory INODE, which is odd while its
+   entries are being rehashed and changes once they have been. */
+unsigned directory_seq(const struct inode *inode) {
+    ASSERT(inode != NULL);
+
+    unsigned seq = inode->dir_seq;
+    barrier();
+    return seq;
+}
+
+/* Waits until directory INODE is no longer being rehashed by another
+   thread. */
+void directory_wait(struct inode *inode) {
+    ASSERT(inode != NULL);
+
+    if (!lock_held_by_current_thread(&inode->dir_lock)) {
+        lock_acquire(&inode->dir_lock);
+        lock_release(&inode->dir_lock);
+    }
+}
+
+/* Advances the sequence count of directory INODE, before and after
+   rehashing it. Rehashing is a change to the directory, so callers
+   hold its lock, as for any other; directory_wait() waits on that. */
+void directory_seq_bump(struct inode *inode) {
+    ASSERT(inode != NULL);
+    ASSERT(lock_held_by_current_thread(&inode->dir_lock));
+
+    barrier();
+    inode->dir_seq++;
+    barrier();
+}
@@ -5,20 +5,38 @@
 #include "filesys/off_t.h"
 #include "devices/block.h"
 
-/* Number of direct, indirect, and double indirect inodes. */
-#define NUM_ENTRIES_IN_INDIRECT (BLOCK_SECTOR_SIZE / 4)
+/* Read-ahead window bounds, in sectors. The cache may hold the window to
+   less than READ_AHEAD_MAX; see cache_read_ahead_max(). */
+#define READ_AHEAD_MIN 4
+#define READ_AHEAD_MAX 64
 
 struct bitmap;
 
+/* Sequential stream detector for one reader of an inode. */
+struct read_ahead {
+    off_t next;                     /* Offset a sequential read starts at. */
+    off_t issued;                   /* End of range already prefetched. */
+    size_t window;                  /* Sectors to prefetch; 0 if random. */
+};
+
 void inode_init(void);
+size_t inode_open_count(void);
 bool inode_create(block_sector_t, off_t, bool);
 struct inode *inode_open(block_sector_t);
 struct inode *inode_reopen(struct inode *);
+void inode_set_metadata(struct inode *);
 block_sector_t inode_get_inumber(const struct inode *);
 void inode_close(struct inode *);
 void inode_remove(struct inode *);
+void inode_reclaim(void);
+void inode_make_room(size_t cnt);
 off_t inode_read_at(struct inode *, void *, off_t size, off_t offset);
+void inode_read_ahead_init(struct read_ahead *);
+off_t inode_read_stream(struct inode *, void *, off_t size, off_t offset,
+                        struct read_ahead *);
 off_t inode_write_at(struct inode *, const void *, off_t size, off_t offset);
+bool inode_replace(struct inode *, const void *, off_t size);
+bool inode_flush(struct inode *, bool data_only);
 void inode_deny_write(struct inode *);
 void inode_allow_write(struct inode *);
 off_t inode_length(const struct inode *);
@@ -34,5 +52,8 @@ int inode_num_files(struct inode *inode);
 
 void directory_lock(struct inode *inode);
 void directory_release(struct inode *inode);
+unsigned directory_seq(const struct inode *inode);
+void directory_wait(struct inode *inode);
+void directory_seq_bump(struct inode *inode);
 
 #endif /* filesys/inode.h */
@@ -0,0 +1,345 @@
+#include "filesys/journal.h"
+#include <debug.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include "filesys/cache.h"
+#include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+
+/*! Identifies the journal header. */
+#define JOURNAL_MAGIC 0x4a524e4c
+
+/*! On-disk journal header, in JOURNAL_SECTOR. The JOURNAL_BLOCKS sectors
+    after it hold copies of metadata sectors. Once the header names the
+    homes of BLOCK_CNT of them, they are committed: they're copied home
+    straight away, and again on every mount until the header is cleared.
+    Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct journal_header {
+    unsigned magic;                 /*!< JOURNAL_MAGIC. */
+    uint32_t seq;                   /*!< Transactions committed so far. */
+    uint32_t block_cnt;             /*!< Blocks committed, or 0 if none. */
+    block_sector_t home[JOURNAL_BLOCKS];  /*!< Where each block belongs. */
+    uint8_t unused[BLOCK_SECTOR_SIZE - 3 * sizeof (uint32_t)
+                   - JOURNAL_BLOCKS * sizeof (block_sector_t)];
+};
+
+/*! Metadata changes go into the running transaction between
+    journal_begin() and journal_end(), and are committed together once no
+    handles are open; a commit waits for open handles to end, and new ones
+    wait for it. Each handle reserves room in the transaction for the
+    sectors it may dirty, so that the transaction never outgrows the
+    journal, nor pins more of the cache than journal_limit. */
+static struct lock journal_lock;        /*!< Guards the variables below. */
+static struct condition journal_idle;   /*!< No handles are open. */
+static struct condition journal_open;   /*!< Handles may be opened. */
+static unsigned handle_cnt;             /*!< Handles open. */
+static bool committing;                 /*!< A commit is under way. */
+static bool enabled;                    /*!< Metadata goes by the journal. */
+static size_t journal_limit;            /*!< Sectors a transaction holds. */
+static size_t reserved;                 /*!< Credits open handles have. */
+static size_t set_aside;                /*!< Room no handle reserves. */
+static size_t set_aside_left;           /*!< Of it, not yet taken. */
+static bool overrun;                    /*!< A handle overran its credits. */
+
+static struct journal_header header;    /*!< Header as last written. */
+static uint8_t *blocks;                 /*!< Blocks being committed. */
+
+static bool journal_full(size_t cnt);
+static void journal_commit_now(void);
+static void journal_commit_running(void);
+static void journal_checkpoint(void);
+static void journal_write(size_t cnt);
+
+/*! Initializes the journal module. The journal isn't used until
+    journal_format() or journal_recover() is called. */
+void journal_init(void) {
+    ASSERT(sizeof header == BLOCK_SECTOR_SIZE);
+
+    lock_init(&journal_lock);
+    cond_init(&journal_idle);
+    cond_init(&journal_open);
+    handle_cnt = 0;
+    committing = false;
+    enabled = false;
+    reserved = 0;
+    set_aside = set_aside_left = 0;
+    overrun = false;
+
+    /* Half the cache is left to sectors that can be evicted, and half the
+       journal to handles that overrun their credits. */
+    journal_limit = cache_get_size() / 2;
+    if (journal_limit > JOURNAL_BLOCKS / 2)
+        journal_limit = JOURNAL_BLOCKS / 2;
+
+    blocks = malloc(JOURNAL_BLOCKS * BLOCK_SECTOR_SIZE);
+    if (blocks == NULL)
+        PANIC("can't allocate journal buffer");
+}
+
+/*! Writes an empty journal to a newly formatted disk, and starts using
+    it. */
+void journal_format(void) {
+    memset(&header, 0, sizeof header);
+    header.magic = JOURNAL_MAGIC;
+    block_write(fs_device, JOURNAL_SECTOR, &header);
+    enabled = true;
+}
+
+/*! Copies the sectors of the transaction the journal holds, if any, to
+    where they belong, and starts using the journal. Must be called
+    before any metadata is read. */
+void journal_recover(void) {
+    block_read(fs_device, JOURNAL_SECTOR, &header);
+    if (header.magic != JOURNAL_MAGIC)
+        PANIC("file system has no journal; it must be formatted anew");
+    if (header.block_cnt > JOURNAL_BLOCKS)
+        PANIC("journal is corrupt");
+
+    if (header.block_cnt > 0) {
+        printf("Replaying %"PRIu32" journaled sectors...\n",
+               header.block_cnt);
+        for (size_t i = 0; i < header.block_cnt; i++) {
+            block_read(fs_device, JOURNAL_SECTOR + 1 + i, blocks);
+            block_write(fs_device, header.home[i], blocks);
+        }
+        header.block_cnt = 0;
+        block_write(fs_device, JOURNAL_SECTOR, &header);
+    }
+    enabled = true;
+}
+
+/*! Commits whatever has been changed, and stops using the journal. */
+void journal_done(void) {
+    journal_commit();
+    enabled = false;
+}
+
+/*! Returns true if metadata goes to disk by way of the journal. */
+bool journal_enabled(void) {
+    return enabled;
+}
+
+/*! Keeps CNT sectors of every transaction out of reach of handles'
+    reservations, for metadata that any handle may have to write on top
+    of its own, such as free map sectors written to make room in its
+    log. journal_take_set_aside() hands them out. */
+void journal_set_aside(size_t cnt) {
+    if (cnt + JOURNAL_LARGE_CREDITS > journal_limit)
+        PANIC("buffer cache too small to journal the free map");
+
+    lock_acquire(&journal_lock);
+    set_aside = set_aside_left = cnt;
+    lock_release(&journal_lock);
+}
+
+/*! Lets the current thread's handle dirty one more sector, out of those
+    set aside in the running transaction. Returns false if they have all
+    been taken; true, without doing anything, if the journal isn't in
+    use. */
+bool journal_take_set_aside(void) {
+    struct thread *t = thread_current();
+
+    if (!enabled)
+        return true;
+
+    lock_acquire(&journal_lock);
+    bool success = set_aside_left > 0;
+    if (success) {
+        set_aside_left--;
+        if (t->journal_depth > 0) {
+            t->journal_credits++;
+            reserved++;
+        }
+    }
+    lock_release(&journal_lock);
+    return success;
+}
+
+/*! Opens a handle that may dirty JOURNAL_HANDLE_CREDITS metadata
+    sectors, as journal_begin_credits() does. */
+void journal_begin(void) {
+    journal_begin_credits(JOURNAL_HANDLE_CREDITS);
+}
+
+/*! Opens a handle: the metadata changes the current thread makes until
+    the matching journal_end() are committed together. There must be
+    room in the running transaction for CNT more sectors, which the
+    handle reserves. Handles nest; only the outermost waits and reserves,
+    so it must be opened before any file system lock is taken, and for
+    all the sectors the handles in it dirty. */
+void journal_begin_credits(size_t cnt) {
+    struct thread *t = thread_current();
+
+    if (t->journal_depth++ > 0)
+        return;
+
+    ASSERT(cnt + set_aside <= journal_limit);
+    lock_acquire(&journal_lock);
+    while (committing || journal_full(cnt)) {
+        if (!committing && handle_cnt == 0) {
+            /* Too much is waiting for a commit, and nobody else can make
+               it. */
+            lock_release(&journal_lock);
+            journal_commit_now();
+            lock_acquire(&journal_lock);
+        } else {
+            cond_wait(&journal_open, &journal_lock);
+        }
+    }
+    handle_cnt++;
+    reserved += cnt;
+    t->journal_credits = cnt;
+    lock_release(&journal_lock);
+}
+
+/*! Closes the handle journal_begin() opened. */
+void journal_end(void) {
+    struct thread *t = thread_current();
+
+    ASSERT(t->journal_depth > 0);
+    if (--t->journal_depth > 0)
+        return;
+
+    lock_acquire(&journal_lock);
+    ASSERT(handle_cnt > 0);
+    reserved -= t->journal_credits;
+    t->journal_credits = 0;
+    if (--handle_cnt == 0)
+        cond_broadcast(&journal_idle, &journal_lock);
+    cond_broadcast(&journal_open, &journal_lock);
+    lock_release(&journal_lock);
+}
+
+/*! Commits the metadata changed so far, and writes it back. A caller
+    with a handle open commits nothing; its changes go with the commit
+    after it ends. Returns false if the journal isn't in use. */
+bool journal_commit(void) {
+    if (!enabled)
+        return false;
+    if (thread_current()->journal_depth == 0 && cache_journal_count() > 0)
+        journal_commit_now();
+    return true;
+}
+
+/*! Charges a metadata sector that the current thread has just left to
+    the journal to its handle. One that has used up its credits may take
+    what room the transaction has spare, bar what is set aside. If there
+    is none, no more handles are opened, and the transaction is committed
+    as soon as those open end; the journal has room for it to run over.
+    Outside a handle, there are no credits to use. */
+void journal_charge(void) {
+    struct thread *t = thread_current();
+
+    lock_acquire(&journal_lock);
+    if (t->journal_credits > 0) {
+        t->journal_credits--;
+        reserved--;
+    } else if (cache_journal_count() + reserved + set_aside_left
+               > journal_limit) {
+        overrun = true;
+    }
+    lock_release(&journal_lock);
+}
+
+/* Returns true if a new handle can't reserve CNT sectors in the running
+   transaction. */
+static bool journal_full(size_t cnt) {
+    ASSERT(lock_held_by_current_thread(&journal_lock));
+
+    return enabled && (overrun || cache_journal_count() + reserved + cnt
+                                  + set_aside_left > journal_limit);
+}
+
+/* Waits for open handles to end, then commits the running transaction.
+   Sectors allocated in it are written first, so that committed metadata
+   never leads to sectors that don't yet hold what was written to them;
+   data rewritten in place is left to write behind. A free map
+   checkpoint, if one is due, follows in transactions of its own. */
+static void journal_commit_now(void) {
+    lock_acquire(&journal_lock);
+    while (committing)
+        cond_wait(&journal_open, &journal_lock);
+    committing = true;
+    while (handle_cnt > 0)
+        cond_wait(&journal_idle, &journal_lock);
+    lock_release(&journal_lock);
+
+    cache_flush_if(free_map_is_new);
+    journal_commit_running();
+    while (free_map_checkpoint_due())
+        journal_checkpoint();
+
+    lock_acquire(&journal_lock);
+    committing = false;
+    cond_broadcast(&journal_open, &journal_lock);
+    lock_release(&journal_lock);
+}
+
+/* Commits the running transaction, once no handles are open. */
+static void journal_commit_running(void) {
+    /* Handles dirty no more than journal_limit sectors between them,
+       bar overruns, which end the transaction early, so it is committed
+       whole. */
+    size_t cnt = cache_journal_collect(header.home, blocks, JOURNAL_BLOCKS);
+    ASSERT(cnt < JOURNAL_BLOCKS);
+    if (cnt > 0)
+        journal_write(cnt);
+
+    /* Sectors freed by the transaction can be reused now that it's on
+       disk. */
+    free_map_commit();
+
+    lock_acquire(&journal_lock);
+    set_aside_left = set_aside;
+    overrun = false;
+    lock_release(&journal_lock);
+}
+
+/* Brings as much of the free map file up to date as a transaction holds,
+   in a handle of the committing thread, which no other handle can be
+   opened beside, and commits it. */
+static void journal_checkpoint(void) {
+    struct thread *t = thread_current();
+    size_t credits = t->journal_credits;
+
+    t->journal_depth++;
+    lock_acquire(&journal_lock);
+    t->journal_credits = journal_limit;
+    reserved += journal_limit;
+    lock_release(&journal_lock);
+
+    free_map_checkpoint(journal_limit - 1);
+
+    lock_acquire(&journal_lock);
+    reserved -= t->journal_credits;
+    lock_release(&journal_lock);
+    t->journal_credits = credits;
+    t->journal_depth--;
+
+    journal_commit_running();
+}
+
+/* Commits the CNT blocks in BLOCKS, which belong in header.home, and
+   writes them back. */
+static void journal_write(size_t cnt) {
+    for (size_t i = 0; i < cnt; i++)
+        block_write(fs_device, JOURNAL_SECTOR + 1 + i,
+                    blocks + i * BLOCK_SECTOR_SIZE);
+
+    /* The transaction is committed once its header is on disk. */
+    header.seq++;
+    header.block_cnt = cnt;
+    block_write(fs_device, JOURNAL_SECTOR, &header);
+
+    for (size_t i = 0; i < cnt; i++)
+        block_write(fs_device, header.home[i],
+                    blocks + i * BLOCK_SECTOR_SIZE);
+    cache_journal_done(header.home, cnt);
+
+    header.block_cnt = 0;
+    block_write(fs_device, JOURNAL_SECTOR, &header);
+}
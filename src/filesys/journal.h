@@ -0,0 +1,35 @@
+#ifndef FILESYS_JOURNAL_H
+#define FILESYS_JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "devices/block.h"
+
+/*! Sectors a single commit can log. The journal takes this many sectors
+    following its header at JOURNAL_SECTOR. */
+#define JOURNAL_BLOCKS 64
+
+/*! Sectors the journal occupies on disk, header included. */
+#define JOURNAL_SECTORS (JOURNAL_BLOCKS + 1)
+
+/*! Metadata sectors journal_begin() lets a handle dirty. */
+#define JOURNAL_HANDLE_CREDITS 8
+
+/*! Metadata sectors a handle that may grow a directory dirties at most. */
+#define JOURNAL_LARGE_CREDITS 16
+
+void journal_init(void);
+void journal_format(void);
+void journal_recover(void);
+void journal_done(void);
+bool journal_enabled(void);
+
+void journal_begin(void);
+void journal_begin_credits(size_t cnt);
+void journal_end(void);
+bool journal_commit(void);
+void journal_charge(void);
+void journal_set_aside(size_t cnt);
+bool journal_take_set_aside(void);
+
+#endif /* filesys/journal.h */
@@ -0,0 +1,81 @@
+#include "filesys/range-lock.h"
+#include <debug.h>
+#include "threads/thread.h"
+
+static bool range_conflicts(const struct range *a, const struct range *b);
+static bool range_holds_any(struct range_lock *rl, struct thread *t);
+
+/*! Initializes RL, with no ranges locked. */
+void range_lock_init(struct range_lock *rl) {
+    lock_init(&rl->lock);
+    cond_init(&rl->released);
+    list_init(&rl->ranges);
+}
+
+/*! Locks bytes START through END, exclusive, of RL's file for the
+    current thread, for writing if WRITE or else for reading, and records
+    the hold in R until range_lock_release(). Waits for conflicting
+    ranges asked for earlier. A thread that already holds a range in RL
+    waits only on ranges that are held, since those it would queue
+    behind may be waiting for it. */
+void range_lock_acquire(struct range_lock *rl, struct range *r,
+                        off_t start, off_t end, bool write) {
+    ASSERT(start <= end);
+
+    r->start = start;
+    r->end = end;
+    r->write = write;
+    r->granted = false;
+    r->holder = thread_current();
+
+    lock_acquire(&rl->lock);
+    bool holding = range_holds_any(rl, r->holder);
+    list_push_back(&rl->ranges, &r->elem);
+    for (;;) {
+        bool blocked = false;
+        for (struct list_elem *e = list_begin(&rl->ranges);
+             e != &r->elem && !blocked; e = list_next(e)) {
+            struct range *other = list_entry(e, struct range, elem);
+            blocked = (other->granted || !holding)
+                && range_conflicts(r, other);
+        }
+        if (!blocked) {
+            break;
+        }
+        cond_wait(&rl->released, &rl->lock);
+    }
+    r->granted = true;
+    lock_release(&rl->lock);
+}
+
+/*! Unlocks the range R, which range_lock_acquire() locked in RL. */
+void range_lock_release(struct range_lock *rl, struct range *r) {
+    ASSERT(r->granted);
+    ASSERT(r->holder == thread_current());
+
+    lock_acquire(&rl->lock);
+    list_remove(&r->elem);
+    cond_broadcast(&rl->released, &rl->lock);
+    lock_release(&rl->lock);
+}
+
+/* Returns true if A has to wait for B: they overlap, at least one of them
+   is for writing, and they're for different threads. */
+static bool range_conflicts(const struct range *a, const struct range *b) {
+    return a->start < b->end && b->start < a->end
+        && (a->write || b->write) && a->holder != b->holder;
+}
+
+/* Returns true if T holds a range in RL. */
+static bool range_holds_any(struct range_lock *rl, struct thread *t) {
+    ASSERT(lock_held_by_current_thread(&rl->lock));
+
+    for (struct list_elem *e = list_begin(&rl->ranges);
+         e != list_end(&rl->ranges); e = list_next(e)) {
+        struct range *r = list_entry(e, struct range, elem);
+        if (r->granted && r->holder == t) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,33 @@
+#ifndef FILESYS_RANGE_LOCK_H
+#define FILESYS_RANGE_LOCK_H
+
+#include <list.h>
+#include <stdbool.h>
+#include "filesys/off_t.h"
+#include "threads/synch.h"
+
+/*! Byte ranges of a file locked for reading or writing. Ranges that
+    overlap are granted in the order they were asked for, except that
+    readers share and a thread never waits on its own ranges. */
+struct range_lock {
+    struct lock lock;                   /*!< Guards ranges. */
+    struct condition released;          /*!< A range was released. */
+    struct list ranges;                 /*!< Held and waiting, oldest first. */
+};
+
+/*! One thread's hold, or wait, on a byte range. */
+struct range {
+    off_t start;                        /*!< First byte. */
+    off_t end;                          /*!< Byte past the last. */
+    bool write;                         /*!< Exclusive? */
+    bool granted;                       /*!< Held, not waiting. */
+    struct thread *holder;              /*!< Thread it's for. */
+    struct list_elem elem;              /*!< Element in ranges. */
+};
+
+void range_lock_init(struct range_lock *);
+void range_lock_acquire(struct range_lock *, struct range *,
+                        off_t start, off_t end, bool write);
+void range_lock_release(struct range_lock *, struct range *);
+
+#endif /* filesys/range-lock.h */
@@ -0,0 +1,42 @@
+/*! \file fsstat.h
+ *
+ * File system statistics, shared between the kernel and user programs,
+ * which read them with the fsstat() system call.
+ */
+
+#ifndef __LIB_FSSTAT_H
+#define __LIB_FSSTAT_H
+
+#include <stdint.h>
+
+/*! Kinds of sector the buffer cache keeps separate counts for. */
+enum cache_class {
+    CACHE_DATA,                 /*!< File contents. */
+    CACHE_META,                 /*!< Inodes, directories, free map. */
+    CACHE_INDEX,                /*!< Indirect and double-indirect blocks. */
+    CACHE_CLASS_CNT             /*!< Number of classes. */
+};
+
+/*! Buffer cache counters for one class of sector. */
+struct cache_stats {
+    unsigned hits;              /*!< Lookups found in the cache. */
+    unsigned misses;            /*!< Sectors filled into the cache. */
+    unsigned evictions;         /*!< Sectors evicted to make room. */
+    unsigned writebacks;        /*!< Dirty sectors written to disk. */
+    unsigned read_ahead_issued; /*!< Sectors filled by read-ahead. */
+    unsigned read_ahead_used;   /*!< Of those, sectors later used. */
+};
+
+/*! Statistics reported by fsstat(). */
+struct fsstat {
+    struct cache_stats cache[CACHE_CLASS_CNT];  /*!< Per class. */
+    unsigned optimistic_reads;  /*!< Reads done without locking an entry. */
+    unsigned optimistic_retries;/*!< Ones that fell back to locking. */
+    unsigned lock_waits;        /*!< Cache lock acquisitions that blocked. */
+    int64_t lock_wait_ticks;    /*!< Timer ticks spent blocked on them. */
+    uint64_t sectors_read;      /*!< File system device sectors read. */
+    uint64_t sectors_written;   /*!< File system device sectors written. */
+    unsigned open_inodes;       /*!< Inodes currently open. */
+};
+
+#endif /* lib/fsstat.h */
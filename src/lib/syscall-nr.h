@@ -34,7 +34,14 @@ enum {
     SYS_MKDIR,                  /*!< Create a directory. */
     SYS_READDIR,                /*!< Reads a directory entry. */
     SYS_ISDIR,                  /*!< Tests if a fd represents a directory. */
-    SYS_INUMBER                 /*!< Returns the inode number for a fd. */
+    SYS_INUMBER,                /*!< Returns the inode number for a fd. */
+
+    /* Statistics. */
+    SYS_FSSTAT,                 /*!< Reports file system statistics. */
+
+    /* Durability. */
+    SYS_FSYNC,                  /*!< Writes a file back to disk. */
+    SYS_FDATASYNC               /*!< Writes a file's data back to disk. */
 };
 
 #endif /* lib/syscall-nr.h */
@@ -153,3 +153,15 @@ int inumber(int fd) {
     return syscall1(SYS_INUMBER, fd);
 }
 
+bool fsstat(struct fsstat *stats) {
+    return syscall1(SYS_FSSTAT, stats);
+}
+
+bool fsync(int fd) {
+    return syscall1(SYS_FSYNC, fd);
+}
+
+bool fdatasync(int fd) {
+    return syscall1(SYS_FDATASYNC, fd);
+}
+
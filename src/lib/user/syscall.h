@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include <debug.h>
+#include <fsstat.h>
 
 /*! Process identifier. */
 typedef int pid_t;
@@ -45,5 +46,12 @@ bool readdir(int fd, char name[READDIR_MAX_LEN + 1]);
 bool isdir(int fd);
 int inumber(int fd);
 
+/* Statistics. */
+bool fsstat(struct fsstat *stats);
+
+/* Durability. */
+bool fsync(int fd);
+bool fdatasync(int fd);
+
 #endif /* lib/user/syscall.h */
 
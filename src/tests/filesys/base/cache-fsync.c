@@ -0,0 +1,85 @@
+/* Writes two files and commits them, then rewrites both in place
+   and checks, with fsstat(), that fsync() on one of them writes
+   its sectors to disk straight away, and none of the other's.
+   Also checks that fdatasync() succeeds. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+/* Sectors fsync() may write besides the file's data: the inode,
+   to the journal and home, and the journal header twice. */
+#define FSYNC_EXTRA 4
+
+/* Times to try, in case write-behind runs in the midst of one. */
+#define TRIES 3
+
+static char buf[4096];
+
+static int
+create_and_write (const char *file_name)
+{
+  int fd;
+
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  random_bytes (buf, sizeof buf);
+  CHECK (write (fd, buf, sizeof buf) == sizeof buf,
+         "write \"%s\"", file_name);
+  return fd;
+}
+
+static void
+rewrite (int fd, const char *file_name)
+{
+  random_bytes (buf, sizeof buf);
+  seek (fd, 0);
+  if (write (fd, buf, sizeof buf) != sizeof buf)
+    fail ("rewrite \"%s\" failed", file_name);
+}
+
+void
+test_main (void) 
+{
+  struct fsstat before, after;
+  unsigned long long written = 0;
+  unsigned long long lo = sizeof buf / 512;
+  unsigned long long hi = lo + FSYNC_EXTRA;
+  int a, b;
+  int try;
+
+  a = create_and_write ("a");
+  b = create_and_write ("b");
+  CHECK (fsync (b), "fsync \"b\"");
+
+  msg ("rewrite both, then fsync \"a\"");
+  for (try = 0; try < TRIES; try++)
+    {
+      rewrite (a, "a");
+      rewrite (b, "b");
+
+      if (!fsstat (&before))
+        fail ("fsstat before fsync failed");
+      if (!fsync (a))
+        fail ("fsync \"a\" failed");
+      if (!fsstat (&after))
+        fail ("fsstat after fsync failed");
+
+      written = after.sectors_written - before.sectors_written;
+      if (written >= lo && written <= hi)
+        break;
+    }
+  if (try == TRIES)
+    fail ("fsync wrote %llu sectors, not between %llu and %llu",
+          written, lo, hi);
+  msg ("fsync wrote \"a\" to disk, and nothing else");
+
+  CHECK (write (a, buf, sizeof buf) == sizeof buf, "write \"a\" again");
+  CHECK (fdatasync (a), "fdatasync \"a\"");
+
+  msg ("close \"a\"");
+  close (a);
+  msg ("close \"b\"");
+  close (b);
+}
@@ -0,0 +1,22 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(cache-fsync) begin
+(cache-fsync) create "a"
+(cache-fsync) open "a"
+(cache-fsync) write "a"
+(cache-fsync) create "b"
+(cache-fsync) open "b"
+(cache-fsync) write "b"
+(cache-fsync) fsync "b"
+(cache-fsync) rewrite both, then fsync "a"
+(cache-fsync) fsync wrote "a" to disk, and nothing else
+(cache-fsync) write "a" again
+(cache-fsync) fdatasync "a"
+(cache-fsync) close "a"
+(cache-fsync) close "b"
+(cache-fsync) end
+EOF
+pass;
@@ -0,0 +1,44 @@
+/* Reads a file that was just written and checks, with fsstat(),
+   that the read is served entirely from the buffer cache. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char buf1[8192];
+static char buf2[8192];
+
+void
+test_main (void) 
+{
+  const char *file_name = "cached";
+  struct fsstat before, after;
+  unsigned hits, misses;
+  int fd;
+
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  random_bytes (buf1, sizeof buf1);
+  CHECK (write (fd, buf1, sizeof buf1) == sizeof buf1,
+         "write \"%s\"", file_name);
+  msg ("seek \"%s\" to 0", file_name);
+  seek (fd, 0);
+
+  CHECK (fsstat (&before), "fsstat before read");
+  CHECK (read (fd, buf2, sizeof buf2) == sizeof buf2,
+         "read \"%s\"", file_name);
+  CHECK (fsstat (&after), "fsstat after read");
+  compare_bytes (buf2, buf1, sizeof buf1, 0, file_name);
+
+  hits = after.cache[CACHE_DATA].hits - before.cache[CACHE_DATA].hits;
+  misses = after.cache[CACHE_DATA].misses - before.cache[CACHE_DATA].misses;
+  if (misses != 0)
+    fail ("%u data sectors missed the cache", misses);
+  if (hits < sizeof buf1 / 512)
+    fail ("only %u data sectors hit the cache", hits);
+  msg ("read served from cache");
+
+  msg ("close \"%s\"", file_name);
+  close (fd);
+}
@@ -0,0 +1,18 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(cache-hit) begin
+(cache-hit) create "cached"
+(cache-hit) open "cached"
+(cache-hit) write "cached"
+(cache-hit) seek "cached" to 0
+(cache-hit) fsstat before read
+(cache-hit) read "cached"
+(cache-hit) fsstat after read
+(cache-hit) read served from cache
+(cache-hit) close "cached"
+(cache-hit) end
+EOF
+pass;
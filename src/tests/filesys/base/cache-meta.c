@@ -0,0 +1,72 @@
+/* Writes every other sector of a file larger than the buffer
+   cache, leaving holes between, so that it takes more extents
+   than its inode holds and needs extent blocks. Streams it
+   through the cache, then checks, with fsstat(), that streaming
+   it again never has to go back to disk for the extent blocks. */
+
+#include <random.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+/* Sectors written, each followed by a hole of one sector. */
+#define DATA_SECTORS 256
+
+static char data[DATA_SECTORS][512];
+static char buf[DATA_SECTORS * 2][512];
+
+static void
+read_all (int fd, const char *file_name) 
+{
+  static char chunk[4096];
+  size_t ofs;
+
+  msg ("seek \"%s\" to 0", file_name);
+  seek (fd, 0);
+  for (ofs = 0; ofs < sizeof buf; ofs += sizeof chunk)
+    {
+      if (read (fd, chunk, sizeof chunk) != sizeof chunk)
+        fail ("read %zu bytes at offset %zu in \"%s\" failed",
+              sizeof chunk, ofs, file_name);
+      compare_bytes (chunk, (char *) buf + ofs, sizeof chunk, ofs,
+                     file_name);
+    }
+}
+
+void
+test_main (void) 
+{
+  const char *file_name = "stream";
+  struct fsstat before, after;
+  unsigned misses;
+  size_t i;
+  int fd;
+
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+
+  random_bytes (data, sizeof data);
+  msg ("write every other sector of \"%s\"", file_name);
+  for (i = 0; i < DATA_SECTORS; i++)
+    {
+      seek (fd, (2 * i + 1) * sizeof *buf);
+      if (write (fd, data[i], sizeof data[i]) != sizeof data[i])
+        fail ("write sector %zu of \"%s\" failed", 2 * i + 1, file_name);
+      memset (buf[2 * i], 0, sizeof buf[2 * i]);
+      memcpy (buf[2 * i + 1], data[i], sizeof buf[2 * i + 1]);
+    }
+  read_all (fd, file_name);
+
+  CHECK (fsstat (&before), "fsstat before second pass");
+  read_all (fd, file_name);
+  CHECK (fsstat (&after), "fsstat after second pass");
+
+  misses = after.cache[CACHE_INDEX].misses - before.cache[CACHE_INDEX].misses;
+  if (misses != 0)
+    fail ("%u extent blocks missed the cache", misses);
+  msg ("extent blocks stayed cached");
+
+  msg ("close \"%s\"", file_name);
+  close (fd);
+}
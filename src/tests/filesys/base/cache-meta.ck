@@ -0,0 +1,18 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(cache-meta) begin
+(cache-meta) create "stream"
+(cache-meta) open "stream"
+(cache-meta) write every other sector of "stream"
+(cache-meta) seek "stream" to 0
+(cache-meta) fsstat before second pass
+(cache-meta) seek "stream" to 0
+(cache-meta) fsstat after second pass
+(cache-meta) extent blocks stayed cached
+(cache-meta) close "stream"
+(cache-meta) end
+EOF
+pass;
@@ -0,0 +1,50 @@
+/* Microbenchmark of concurrent readers of one cached sector.
+   Spawns several child processes that all make many small reads
+   of the same sector, then reports, with fsstat(), how many of
+   those reads the buffer cache served without locking the
+   sector's entry, how many had to retry under the lock, and how
+   often cache locks blocked. */
+
+#include <random.h>
+#include <stdio.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+#include "tests/filesys/base/cache-readers.h"
+
+static char buf[BUF_SIZE];
+
+#define CHILD_CNT 8
+
+void
+test_main (void) 
+{
+  pid_t children[CHILD_CNT];
+  struct fsstat before, after;
+  unsigned optimistic, retries;
+  int fd;
+
+  CHECK (create (file_name, sizeof buf), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  random_bytes (buf, sizeof buf);
+  CHECK (write (fd, buf, sizeof buf) > 0, "write \"%s\"", file_name);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+
+  CHECK (fsstat (&before), "fsstat before reads");
+  exec_children ("child-cache-rd", children, CHILD_CNT);
+  wait_children (children, CHILD_CNT);
+  CHECK (fsstat (&after), "fsstat after reads");
+
+  optimistic = after.optimistic_reads - before.optimistic_reads;
+  retries = after.optimistic_retries - before.optimistic_retries;
+  msg ("bench: %d readers x %d reads of %d bytes", CHILD_CNT, READ_CNT,
+       READ_SIZE);
+  msg ("bench: %u optimistic reads, %u retried under lock", optimistic,
+       retries);
+  msg ("bench: %u lock waits, %lld ticks waiting",
+       after.lock_waits - before.lock_waits,
+       after.lock_wait_ticks - before.lock_wait_ticks);
+  if (optimistic == 0)
+    fail ("no read avoided locking the cache entry");
+}
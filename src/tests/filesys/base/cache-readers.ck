@@ -0,0 +1,40 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+our ($test);
+my (@output) = read_text_file ("$test.output");
+common_checks ("run", @output);
+
+# Benchmark results vary from run to run; only require that they're there.
+my (@bench) = grep (/^\(cache-readers\) bench: /, @output);
+fail "missing benchmark results\n" if @bench != 3;
+@output = grep (!/^\(cache-readers\) bench: /, @output);
+
+compare_output ("run", IGNORE_EXIT_CODES => 1, \@output, [<<'EOF']);
+(cache-readers) begin
+(cache-readers) create "hot"
+(cache-readers) open "hot"
+(cache-readers) write "hot"
+(cache-readers) close "hot"
+(cache-readers) fsstat before reads
+(cache-readers) exec child 1 of 8: "child-cache-rd 0"
+(cache-readers) exec child 2 of 8: "child-cache-rd 1"
+(cache-readers) exec child 3 of 8: "child-cache-rd 2"
+(cache-readers) exec child 4 of 8: "child-cache-rd 3"
+(cache-readers) exec child 5 of 8: "child-cache-rd 4"
+(cache-readers) exec child 6 of 8: "child-cache-rd 5"
+(cache-readers) exec child 7 of 8: "child-cache-rd 6"
+(cache-readers) exec child 8 of 8: "child-cache-rd 7"
+(cache-readers) wait for child 1 of 8 returned 0 (expected 0)
+(cache-readers) wait for child 2 of 8 returned 1 (expected 1)
+(cache-readers) wait for child 3 of 8 returned 2 (expected 2)
+(cache-readers) wait for child 4 of 8 returned 3 (expected 3)
+(cache-readers) wait for child 5 of 8 returned 4 (expected 4)
+(cache-readers) wait for child 6 of 8 returned 5 (expected 5)
+(cache-readers) wait for child 7 of 8 returned 6 (expected 6)
+(cache-readers) wait for child 8 of 8 returned 7 (expected 7)
+(cache-readers) fsstat after reads
+(cache-readers) end
+EOF
+pass;
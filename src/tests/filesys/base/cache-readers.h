@@ -0,0 +1,9 @@
+#ifndef TESTS_FILESYS_BASE_CACHE_READERS_H
+#define TESTS_FILESYS_BASE_CACHE_READERS_H
+
+#define BUF_SIZE 512
+#define READ_SIZE 16
+#define READ_CNT 2000
+static const char file_name[] = "hot";
+
+#endif /* tests/filesys/base/cache-readers.h */
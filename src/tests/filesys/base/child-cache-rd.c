@@ -0,0 +1,45 @@
+/* Child process for cache-readers test.
+   Reads the same few bytes of the test file over and over, so
+   that the reads are all hits on a single cache entry. */
+
+#include <random.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/filesys/base/cache-readers.h"
+
+const char *test_name = "child-cache-rd";
+
+static char buf[BUF_SIZE];
+
+int
+main (int argc, const char *argv[]) 
+{
+  int child_idx;
+  size_t ofs;
+  int fd;
+  int i;
+
+  quiet = true;
+  
+  CHECK (argc == 2, "argc must be 2, actually %d", argc);
+  child_idx = atoi (argv[1]);
+  ofs = (child_idx * READ_SIZE) % BUF_SIZE;
+
+  random_init (0);
+  random_bytes (buf, sizeof buf);
+
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  for (i = 0; i < READ_CNT; i++) 
+    {
+      char data[READ_SIZE];
+      seek (fd, ofs);
+      CHECK (read (fd, data, sizeof data) == sizeof data,
+             "read \"%s\"", file_name);
+      compare_bytes (data, buf + ofs, sizeof data, ofs, file_name);
+    }
+  close (fd);
+
+  return child_idx;
+}
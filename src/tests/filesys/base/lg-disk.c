@@ -0,0 +1,48 @@
+/* Formats and mounts a disk whose free map takes many sectors,
+   then writes a file to it in pieces, removing a second file
+   written between them, and checks that it can be read back
+   after fsync(). */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define PIECE_SIZE 8192
+#define PIECE_CNT 32
+
+static char buf[PIECE_SIZE * PIECE_CNT];
+
+void
+test_main (void) 
+{
+  int fd, other;
+  size_t i;
+
+  random_bytes (buf, sizeof buf);
+  CHECK (create ("file", 0), "create \"file\"");
+  CHECK ((fd = open ("file")) > 1, "open \"file\"");
+
+  msg ("write \"file\" and \"other\" in turn");
+  for (i = 0; i < PIECE_CNT; i++)
+    {
+      if (write (fd, buf + i * PIECE_SIZE, PIECE_SIZE) != PIECE_SIZE)
+        fail ("write %zu bytes at offset %zu in \"file\" failed",
+              (size_t) PIECE_SIZE, i * PIECE_SIZE);
+      if (!create ("other", PIECE_SIZE))
+        fail ("create \"other\" failed");
+      if ((other = open ("other")) < 2)
+        fail ("open \"other\" failed");
+      if (write (other, buf, PIECE_SIZE) != PIECE_SIZE)
+        fail ("write \"other\" failed");
+      close (other);
+      if (!remove ("other"))
+        fail ("remove \"other\" failed");
+    }
+
+  CHECK (fsync (fd), "fsync \"file\"");
+  msg ("close \"file\"");
+  close (fd);
+
+  check_file ("file", buf, sizeof buf);
+}
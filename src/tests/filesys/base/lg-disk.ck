@@ -0,0 +1,17 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(lg-disk) begin
+(lg-disk) create "file"
+(lg-disk) open "file"
+(lg-disk) write "file" and "other" in turn
+(lg-disk) fsync "file"
+(lg-disk) close "file"
+(lg-disk) open "file" for verification
+(lg-disk) verified contents of "file"
+(lg-disk) close "file"
+(lg-disk) end
+EOF
+pass;
@@ -0,0 +1,92 @@
+/* Streams half a megabyte into the end of a file a gigabyte long,
+   far longer than the file system disk, a chunk at a time.  Checks,
+   with fsstat(), that each chunk takes about as many sectors to
+   write back, and to read back, as the first, however far into the
+   file it lies, then checks what was read. */
+
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_SIZE (1024 * 1024 * 1024)
+#define STREAM_SIZE (512 * 1024)
+#define CHUNK_SIZE (64 * 1024)
+#define CHUNK_CNT (STREAM_SIZE / CHUNK_SIZE)
+#define CHUNK_SECTORS (CHUNK_SIZE / 512)
+
+/* Sectors a chunk may cost beyond its own, for metadata and
+   read-ahead. */
+#define SLACK 64
+
+static char buf[CHUNK_SIZE];
+
+/* Fills BUF with the contents of chunk I. */
+static void
+fill_chunk (int i) 
+{
+  size_t j;
+
+  for (j = 0; j < sizeof buf; j++)
+    buf[j] = (char) (i * 7 + j % 251);
+}
+
+void
+test_main (void) 
+{
+  struct fsstat before, after;
+  unsigned long long cost, first = 0;
+  int fd, i;
+  size_t j;
+
+  CHECK (create ("stream", 0), "create \"stream\"");
+  CHECK ((fd = open ("stream")) > 1, "open \"stream\"");
+
+  msg ("write %d chunks of %d bytes at %d", CHUNK_CNT, CHUNK_SIZE,
+       FILE_SIZE - STREAM_SIZE);
+  seek (fd, FILE_SIZE - STREAM_SIZE);
+  for (i = 0; i < CHUNK_CNT; i++) 
+    {
+      fill_chunk (i);
+      if (!fsstat (&before))
+        fail ("fsstat before chunk %d", i);
+      if (write (fd, buf, sizeof buf) != sizeof buf)
+        fail ("write chunk %d", i);
+      if (!fsync (fd))
+        fail ("fsync chunk %d", i);
+      if (!fsstat (&after))
+        fail ("fsstat after chunk %d", i);
+
+      cost = after.sectors_written - before.sectors_written;
+      if (i == 0)
+        first = cost;
+      if (cost > CHUNK_SECTORS + SLACK || cost > first + SLACK)
+        fail ("writing chunk %d wrote %llu sectors, the first %llu",
+              i, cost, first);
+    }
+  msg ("each chunk wrote about as many sectors as the first");
+
+  CHECK (filesize (fd) == FILE_SIZE, "filesize \"stream\"");
+
+  msg ("read back %d chunks", CHUNK_CNT);
+  seek (fd, FILE_SIZE - STREAM_SIZE);
+  for (i = 0; i < CHUNK_CNT; i++) 
+    {
+      if (!fsstat (&before))
+        fail ("fsstat before chunk %d", i);
+      if (read (fd, buf, sizeof buf) != sizeof buf)
+        fail ("read chunk %d", i);
+      if (!fsstat (&after))
+        fail ("fsstat after chunk %d", i);
+
+      cost = after.sectors_read - before.sectors_read;
+      if (cost > CHUNK_SECTORS + SLACK)
+        fail ("reading chunk %d read %llu sectors", i, cost);
+      for (j = 0; j < sizeof buf; j++)
+        if (buf[j] != (char) (i * 7 + j % 251))
+          fail ("byte %zu of chunk %d is %d", j, i, buf[j]);
+    }
+  msg ("each chunk read back intact from about as many sectors");
+
+  msg ("close \"stream\"");
+  close (fd);
+}
@@ -0,0 +1,17 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(lg-stream) begin
+(lg-stream) create "stream"
+(lg-stream) open "stream"
+(lg-stream) write 8 chunks of 65536 bytes at 1073217536
+(lg-stream) each chunk wrote about as many sectors as the first
+(lg-stream) filesize "stream"
+(lg-stream) read back 8 chunks
+(lg-stream) each chunk read back intact from about as many sectors
+(lg-stream) close "stream"
+(lg-stream) end
+EOF
+pass;
@@ -0,0 +1,58 @@
+/* Writes a byte far past the end of an empty file, further than
+   the file system disk is large, then checks, with fsstat(), that
+   only a few sectors were written to disk to do it, and that the
+   hole before it reads back as zeros without reading the disk. */
+
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define HOLE (7 * 1024 * 1024)
+
+static char buf[4096];
+
+void
+test_main (void) 
+{
+  struct fsstat before, after;
+  unsigned long long written, read_cnt;
+  size_t i;
+  int fd;
+
+  CHECK (create ("sparse", 0), "create \"sparse\"");
+  CHECK ((fd = open ("sparse")) > 1, "open \"sparse\"");
+
+  CHECK (fsstat (&before), "fsstat before write");
+  msg ("seek \"sparse\" to %d", HOLE);
+  seek (fd, HOLE);
+  CHECK (write (fd, "x", 1) == 1, "write \"sparse\"");
+  CHECK (fsync (fd), "fsync \"sparse\"");
+  CHECK (fsstat (&after), "fsstat after write");
+
+  written = after.sectors_written - before.sectors_written;
+  if (written > 64)
+    fail ("writing 1 byte wrote %llu sectors", written);
+  msg ("write wrote only a few sectors");
+
+  CHECK (filesize (fd) == HOLE + 1, "filesize \"sparse\"");
+
+  CHECK (fsstat (&before), "fsstat before read");
+  msg ("seek \"sparse\" to 0");
+  seek (fd, 0);
+  CHECK (read (fd, buf, sizeof buf) == sizeof buf, "read \"sparse\"");
+  CHECK (fsstat (&after), "fsstat after read");
+  for (i = 0; i < sizeof buf; i++)
+    if (buf[i] != 0)
+      fail ("byte %zu of hole is %d, not 0", i, buf[i]);
+  read_cnt = after.sectors_read - before.sectors_read;
+  if (read_cnt != 0)
+    fail ("reading hole read %llu sectors", read_cnt);
+  msg ("hole reads as zeros from no sectors");
+
+  msg ("seek \"sparse\" to %d", HOLE);
+  seek (fd, HOLE);
+  CHECK (read (fd, buf, 1) == 1 && buf[0] == 'x', "read back \"x\"");
+
+  msg ("close \"sparse\"");
+  close (fd);
+}
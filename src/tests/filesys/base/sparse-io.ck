@@ -0,0 +1,26 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(sparse-io) begin
+(sparse-io) create "sparse"
+(sparse-io) open "sparse"
+(sparse-io) fsstat before write
+(sparse-io) seek "sparse" to 7340032
+(sparse-io) write "sparse"
+(sparse-io) fsync "sparse"
+(sparse-io) fsstat after write
+(sparse-io) write wrote only a few sectors
+(sparse-io) filesize "sparse"
+(sparse-io) fsstat before read
+(sparse-io) seek "sparse" to 0
+(sparse-io) read "sparse"
+(sparse-io) fsstat after read
+(sparse-io) hole reads as zeros from no sectors
+(sparse-io) seek "sparse" to 7340032
+(sparse-io) read back "x"
+(sparse-io) close "sparse"
+(sparse-io) end
+EOF
+pass;
@@ -70,6 +70,9 @@ static const char *scratch_bdev_name;
 #ifdef VM
 static const char *swap_bdev_name;
 #endif
+
+/* -cache: Number of sectors to put into the buffer cache. */
+static size_t cache_sectors = CACHE_SIZE;
 #endif /* FILESYS */
 
 /*! -ul: Maximum number of pages to put into palloc's user pool. */
@@ -140,7 +143,7 @@ int main(void) {
     /* Initialize file system. */
     ide_init();
     locate_block_devices();
-    cache_init();
+    cache_init(cache_sectors);
     cache_kernel_thread_init();
     filesys_init(format_filesys);
 
@@ -261,6 +264,16 @@ static char ** parse_options(char **argv) {
             filesys_bdev_name = value;
         else if (!strcmp(name, "-scratch"))
             scratch_bdev_name = value;
+        else if (!strcmp(name, "-cache"))
+            cache_sectors = atoi(value);
+        else if (!strcmp(name, "-cache-meta")) {
+            if (value == NULL || !cache_set_meta_percent(atoi(value)))
+                PANIC("-cache-meta must be a percentage");
+        }
+        else if (!strcmp(name, "-cache-policy")) {
+            if (value == NULL || !cache_set_policy(value))
+                PANIC("unknown cache policy `%s'", value);
+        }
 #ifdef VM
         else if (!strcmp(name, "-swap"))
             swap_bdev_name = value;
@@ -381,6 +394,9 @@ static void usage(void) {
            "  -f                 Format file system device during startup.\n"
            "  -filesys=BDEV      Use BDEV for file system instead of default.\n"
            "  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
+           "  -cache=COUNT       Use COUNT sectors of buffer cache.\n"
+           "  -cache-meta=PCT    Reserve PCT%% of the cache for metadata.\n"
+           "  -cache-policy=NAME Replace cached sectors by NAME (2q, lru).\n"
 #ifdef VM
            "  -swap=BDEV         Use BDEV for swap instead of default.\n"
 #endif
@@ -418,6 +418,8 @@ tid_t thread_create(const char *name, int priority, thread_func *function,
 
 #ifdef FILESYS
     t->cur_directory = thread_current()->cur_directory;
+    t->journal_depth = 0;
+    t->journal_credits = 0;
 #endif
 
     /* Stack frame for kernel_thread(). */
@@ -193,6 +193,8 @@ struct thread {
 
 #ifdef FILESYS
     block_sector_t cur_directory;
+    int journal_depth;                  /*!< Journal handles open. */
+    size_t journal_credits;             /*!< Sectors its handle may dirty. */
 #endif
     /*! Owned by thread.c. */
     /**@{*/
@@ -23,8 +23,10 @@
 #include "vm/page.h"
 #endif
 
+#include "filesys/cache.h"
 #include "filesys/directory.h"
 #include "filesys/filesys.h"
+#include "filesys/free-map.h"
 #include "filesys/inode.h"
 
 
@@ -66,6 +68,10 @@ static void    mkdir(struct intr_frame *f);
 static void  readdir(struct intr_frame *f);
 static void    isdir(struct intr_frame *f);
 static void  inumber(struct intr_frame *f);
+static void   fsstat(struct intr_frame *f);
+static void    fsync(struct intr_frame *f);
+static void fdatasync(struct intr_frame *f);
+static void  sync_fd(struct intr_frame *f, bool data_only);
 #endif
 
 
@@ -194,6 +200,9 @@ static void syscall_handler(struct intr_frame *f) {
         case SYS_READDIR :  readdir(f);  break;     /* 17 */
         case SYS_ISDIR :    isdir(f);    break;     /* 18 */
         case SYS_INUMBER :  inumber(f);  break;     /* 19 */
+        case SYS_FSSTAT :   fsstat(f);   break;     /* 20 */
+        case SYS_FSYNC :    fsync(f);    break;     /* 21 */
+        case SYS_FDATASYNC : fdatasync(f); break;   /* 22 */
 #endif
 
         /* Invalid syscall. */
@@ -801,5 +810,55 @@ static void inumber(struct intr_frame *f) {
 
     f->eax = (uint32_t) inode_get_sector(inode);
 }
+
+/*!< Reports file system statistics. */
+static void fsstat(struct intr_frame *f) {
+    /* Parse arguments. */
+    struct fsstat *stats = (struct fsstat *) get_arg(f, 1);
+
+    /* The whole struct must be mapped user memory. */
+    verify_pointer((uint32_t *) stats);
+    verify_pointer((uint32_t *) ((uint8_t *) (stats + 1) - 1));
+
+    cache_get_stats(stats);
+    stats->open_inodes = inode_open_count();
+    f->eax = (uint32_t) true;
+}
+
+/*!< Writes a file back to disk. */
+static void fsync(struct intr_frame *f) {
+    sync_fd(f, false);
+}
+
+/*!< Writes a file's data back to disk. */
+static void fdatasync(struct intr_frame *f) {
+    sync_fd(f, true);
+}
+
+/* Writes the file or directory open as fd back to disk, only as much as
+   is needed to read its data back if DATA_ONLY. Returns success. */
+static void sync_fd(struct intr_frame *f, bool data_only) {
+    /* Parse arguments. */
+    int fd = get_arg(f, 1);
+
+    /* Special cases. */
+    if (fd == STDIN_FILENO || fd == STDOUT_FILENO) {
+        f->eax = (uint32_t) false;
+        return;
+    }
+
+    struct file_des *fd_s = file_from_fd(fd);
+    struct inode *inode = fd_s->file != NULL ? file_get_inode(fd_s->file)
+                                             : dir_get_inode(fd_s->dir);
+    if (inode == NULL) {
+        f->eax = (uint32_t) false;
+        return;
+    }
+
+    /* Its sectors' allocation must be as durable as their contents. */
+    bool success = inode_flush(inode, data_only);
+    free_map_flush();
+    f->eax = (uint32_t) success;
+}
 #endif
 